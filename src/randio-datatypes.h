@@ -1,23 +1,37 @@
 #include <gtk/gtk.h>
 
+/*
+ * A snapshot of the track that is playing. Snapshots are reference counted
+ * and never change once they have been published, when we learn more about
+ * the track (ie. its tags) a new one replaces it. See trackGetCurrent().
+ */
 struct trackTag
 {
-  char trackName[254];
-  char trackArtist[254];
-  char trackAlbum[254];
-  char trackLength[254];
+  gint refs;
+  int trackID;
+  /* The URI being played, NULL if nothing is */
   char *currTrackPath;
+  /* Interned with g_intern_string(), NULL until the tags arrive */
+  const char *trackName;
+  const char *trackArtist;
+  const char *trackAlbum;
+  /* In seconds, 0 if it isn't known yet */
   int trackLenSeconds;
-  int trackID;
-  bool submittedNowPlaying;
-  bool scrobbled;
+  int startedPlaying;
   bool hasBasicInfo;
   bool hasAlbum;
-  bool notificationDisplayed;
-  int startedPlaying;
-  GMutex lock;
+  /* TRACK_* flags. The only part that changes, always accessed atomically,
+   * and carried over to the snapshots that replace this one */
+  gint flags;
 };
 
+/* Set once "now playing" has been sent to last.fm */
+#define TRACK_SUBMITTED_NOW_PLAYING (1 << 0)
+/* Set once the track has been scrobbled */
+#define TRACK_SCROBBLED (1 << 1)
+/* Set once the desktop notification has been shown */
+#define TRACK_NOTIFIED (1 << 2)
+
 struct randioGlobalStateStruct
 {
   GtkWidget *mainWindow;
@@ -0,0 +1,388 @@
+/*
+ * Randio music player
+ * Database writer thread
+ * Copyright (C) Eskild Hustvedt 2011, 2012, 2017
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include <sqlite3.h>
+
+#include "randio-datatypes.h"
+#include "randio-sql.h"
+#include "randio-dbwriter.h"
+
+/*
+ * All writes to the database go through a single writer thread. Everyone
+ * else posts operations to a bounded queue, and the writer applies them
+ * inside a transaction that is committed once it has grown large enough, once
+ * it has been open for long enough, or once the queue runs dry. This means
+ * that there is only ever one BEGIN/COMMIT in flight on our connection, no
+ * matter how many scans are running.
+ *
+ * The limits are kept small so that tracks found by a scan become visible
+ * to the player (which reads outside of our transactions) while the scan is
+ * still running, rather than once it is done.
+ */
+
+/* The maximum number of operations waiting in the queue. Posting blocks
+ * when it is full */
+#define DB_WRITER_QUEUE_SIZE 1024
+/* Commit after this many rows have been written.. */
+#define DB_WRITER_MAX_BATCH_ROWS 2000
+/* ..or once the transaction has been open for this long */
+#define DB_WRITER_MAX_BATCH_USEC (250*G_TIME_SPAN_MILLISECOND)
+
+struct dbWriterOp
+{
+  /* NULL for barriers */
+  void (*apply) (gpointer data);
+  gpointer data;
+  GDestroyNotify destroy;
+  /* The (approximate) number of rows apply writes */
+  unsigned int rows;
+};
+
+/* Used to wait for the writer to catch up */
+struct dbWriterBarrier
+{
+  GMutex lock;
+  GCond cond;
+  bool reached;
+  /* Stop the writer once the barrier has been reached */
+  bool stop;
+};
+
+/* A statement with at most one parameter, see dbWriterExec* */
+struct dbWriterStatement
+{
+  const char *SQL;
+  gint64 intParam;
+  char *textParam;
+};
+
+/* A setting waiting to be stored, see dbWriterSetSetting */
+struct dbWriterSetting
+{
+  char *key;
+  char *value;
+};
+
+static GQueue writerQueue = G_QUEUE_INIT;
+static GMutex writerLock;
+static GCond writerNotEmpty;
+static GCond writerNotFull;
+static GThread *writerThread = NULL;
+static void (*commitHook) (void) = NULL;
+
+/*
+ * Push an operation onto the queue, waiting for room if it is full
+ */
+static void dbWriterPush (struct dbWriterOp *op)
+{
+  g_mutex_lock(&writerLock);
+  while(writerQueue.length >= DB_WRITER_QUEUE_SIZE)
+  {
+    g_cond_wait(&writerNotFull,&writerLock);
+  }
+  g_queue_push_tail(&writerQueue,op);
+  g_cond_signal(&writerNotEmpty);
+  g_mutex_unlock(&writerLock);
+}
+
+/*
+ * Fetch the next operation. If a transaction is open we only wait until
+ * deadline, returning NULL if nothing arrived before then.
+ */
+static struct dbWriterOp *dbWriterPop (bool inTransaction, gint64 deadline)
+{
+  struct dbWriterOp *op;
+
+  g_mutex_lock(&writerLock);
+  while( (op = g_queue_pop_head(&writerQueue)) == NULL )
+  {
+    if(!inTransaction)
+    {
+      g_cond_wait(&writerNotEmpty,&writerLock);
+    }
+    else if(!g_cond_wait_until(&writerNotEmpty,&writerLock,deadline))
+    {
+      // Timed out, one last look before we give up
+      op = g_queue_pop_head(&writerQueue);
+      break;
+    }
+  }
+  if(op != NULL)
+  {
+    g_cond_signal(&writerNotFull);
+  }
+  g_mutex_unlock(&writerLock);
+  return op;
+}
+
+/*
+ * The writer thread
+ */
+static gpointer dbWriterRun (gpointer user_data)
+{
+  struct dbWriterOp *op;
+  gint64 batchStarted = 0;
+  unsigned int batchOps = 0;
+  unsigned int batchRows = 0;
+  bool stop = false;
+
+  while(!stop)
+  {
+    op = dbWriterPop(batchOps > 0, batchStarted+DB_WRITER_MAX_BATCH_USEC);
+
+    if(op != NULL && op->apply != NULL)
+    {
+      if(batchOps == 0)
+      {
+        SQL_exec("BEGIN");
+        batchStarted = g_get_monotonic_time();
+      }
+      op->apply(op->data);
+      batchOps++;
+      batchRows += op->rows;
+    }
+
+    /*
+     * Commit if we've hit one of the limits, if the queue ran dry before the
+     * deadline, or if someone is waiting for us
+     */
+    if(batchOps > 0 && (op == NULL || op->apply == NULL ||
+          batchRows >= DB_WRITER_MAX_BATCH_ROWS ||
+          g_get_monotonic_time()-batchStarted >= DB_WRITER_MAX_BATCH_USEC))
+    {
+      SQL_exec("COMMIT");
+      batchOps  = 0;
+      batchRows = 0;
+      if(commitHook != NULL)
+      {
+        commitHook();
+      }
+    }
+
+    if(op == NULL)
+    {
+      continue;
+    }
+
+    if(op->apply == NULL)
+    {
+      struct dbWriterBarrier *barrier = op->data;
+      stop = barrier->stop;
+      g_mutex_lock(&barrier->lock);
+      barrier->reached = true;
+      g_cond_signal(&barrier->cond);
+      g_mutex_unlock(&barrier->lock);
+    }
+    else if(op->destroy != NULL)
+    {
+      op->destroy(op->data);
+    }
+    free(op);
+  }
+  return NULL;
+}
+
+/*
+ * Post a barrier and wait for the writer to reach it
+ */
+static void dbWriterWaitForBarrier (bool stop)
+{
+  struct dbWriterBarrier barrier;
+  struct dbWriterOp *op = malloc(sizeof(struct dbWriterOp));
+
+  g_mutex_init(&barrier.lock);
+  g_cond_init(&barrier.cond);
+  barrier.reached = false;
+  barrier.stop    = stop;
+
+  op->apply   = NULL;
+  op->data    = &barrier;
+  op->destroy = NULL;
+  op->rows    = 0;
+  dbWriterPush(op);
+
+  g_mutex_lock(&barrier.lock);
+  while(!barrier.reached)
+  {
+    g_cond_wait(&barrier.cond,&barrier.lock);
+  }
+  g_mutex_unlock(&barrier.lock);
+
+  g_mutex_clear(&barrier.lock);
+  g_cond_clear(&barrier.cond);
+}
+
+/*
+ * Queue a write. apply is called with data on the writer thread, inside a
+ * transaction, and destroy (if not NULL) is called on data afterwards.
+ * Blocks if the queue is full.
+ */
+void dbWriterPost (void (*apply) (gpointer data), gpointer data, GDestroyNotify destroy)
+{
+  dbWriterPostRows(apply,data,destroy,1);
+}
+
+/*
+ * Like dbWriterPost, for operations that write many rows at once. rows is
+ * used to decide when to commit.
+ */
+void dbWriterPostRows (void (*apply) (gpointer data), gpointer data, GDestroyNotify destroy, unsigned int rows)
+{
+  struct dbWriterOp *op = malloc(sizeof(struct dbWriterOp));
+  op->apply   = apply;
+  op->data    = data;
+  op->destroy = destroy;
+  op->rows    = rows;
+  dbWriterPush(op);
+}
+
+/*
+ * Set a function to be called on the writer thread after every commit. It
+ * must be quick, as it holds up all writes.
+ */
+void dbWriterSetCommitHook (void (*hook) (void))
+{
+  commitHook = hook;
+}
+
+/*
+ * Wait until everything posted so far has been committed
+ */
+void dbWriterSync (void)
+{
+  dbWriterWaitForBarrier(false);
+}
+
+static void dbWriterApplyStatement (struct dbWriterStatement *statement)
+{
+  sqlite3_stmt *prepared;
+  prepared = SQL_prepare(statement->SQL);
+  if(sqlite3_bind_parameter_count(prepared) == 0)
+  {
+    // Nothing to bind
+  }
+  else if(statement->textParam != NULL)
+  {
+    sqlite3_bind_text(prepared,1,statement->textParam,-1,NULL);
+  }
+  else
+  {
+    sqlite3_bind_int64(prepared,1,statement->intParam);
+  }
+  sqlite3_step(prepared);
+  SQL_release(prepared);
+}
+
+static void dbWriterFreeStatement (struct dbWriterStatement *statement)
+{
+  free(statement->textParam);
+  free(statement);
+}
+
+/*
+ * Queue a statement without any parameters. SQL must be a string constant.
+ */
+void dbWriterExec (const char *SQL)
+{
+  dbWriterExecInt(SQL,0);
+}
+
+/*
+ * Queue a statement with a single integer parameter. SQL must be a string
+ * constant.
+ */
+void dbWriterExecInt (const char *SQL, gint64 param)
+{
+  struct dbWriterStatement *statement = malloc(sizeof(struct dbWriterStatement));
+  statement->SQL       = SQL;
+  statement->intParam  = param;
+  statement->textParam = NULL;
+  dbWriterPost((void (*) (gpointer)) dbWriterApplyStatement,statement,(GDestroyNotify) dbWriterFreeStatement);
+}
+
+/*
+ * Queue a statement with a single text parameter. SQL must be a string
+ * constant, param is copied.
+ */
+void dbWriterExecText (const char *SQL, const char *param)
+{
+  struct dbWriterStatement *statement = malloc(sizeof(struct dbWriterStatement));
+  statement->SQL       = SQL;
+  statement->intParam  = 0;
+  statement->textParam = strdup(param);
+  dbWriterPost((void (*) (gpointer)) dbWriterApplyStatement,statement,(GDestroyNotify) dbWriterFreeStatement);
+}
+
+static void dbWriterApplySetting (struct dbWriterSetting *setting)
+{
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepare("INSERT INTO settings (name,value) VALUES (?1,?2) ON CONFLICT (name) DO UPDATE SET value=excluded.value");
+  sqlite3_bind_text(statement,1,setting->key,-1,NULL);
+  sqlite3_bind_text(statement,2,setting->value,-1,NULL);
+  sqlite3_step(statement);
+  SQL_release(statement);
+}
+
+static void dbWriterFreeSetting (struct dbWriterSetting *setting)
+{
+  free(setting->key);
+  free(setting->value);
+  free(setting);
+}
+
+/*
+ * Queue a change to a setting, see SQL_getSetting(). key and value are
+ * copied.
+ */
+void dbWriterSetSetting (const char *key, const char *value)
+{
+  struct dbWriterSetting *setting = malloc(sizeof(struct dbWriterSetting));
+  setting->key   = strdup(key);
+  setting->value = strdup(value);
+  dbWriterPost((void (*) (gpointer)) dbWriterApplySetting,setting,(GDestroyNotify) dbWriterFreeSetting);
+}
+
+/*
+ * Start the writer thread. Called during startup, after SQLite_init
+ */
+void dbWriterInit (void)
+{
+  writerThread = g_thread_new("dbWriter",dbWriterRun,NULL);
+}
+
+/*
+ * Commit anything that is pending and stop the writer thread
+ */
+void dbWriterShutdown (void)
+{
+  if(writerThread == NULL)
+  {
+    return;
+  }
+  dbWriterWaitForBarrier(true);
+  g_thread_join(writerThread);
+  writerThread = NULL;
+}
@@ -0,0 +1,10 @@
+void dbWriterPost (void (*apply) (gpointer data), gpointer data, GDestroyNotify destroy);
+void dbWriterPostRows (void (*apply) (gpointer data), gpointer data, GDestroyNotify destroy, unsigned int rows);
+void dbWriterSetCommitHook (void (*hook) (void));
+void dbWriterSync (void);
+void dbWriterExec (const char *SQL);
+void dbWriterExecInt (const char *SQL, gint64 param);
+void dbWriterExecText (const char *SQL, const char *param);
+void dbWriterSetSetting (const char *key, const char *value);
+void dbWriterInit (void);
+void dbWriterShutdown (void);
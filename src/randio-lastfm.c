@@ -31,6 +31,7 @@
 
 #include "randio-datatypes.h"
 #include "randio-sql.h"
+#include "randio-dbwriter.h"
 #include "randio-lastfm.h"
 
 bool lastfmEnabled = false;
@@ -124,8 +125,8 @@ void lastfmConnect (GtkButton *button, GtkWindow *prefsWin)
   {
     const char *key = getNodeContentFromREST(call, "key");
     const char *name = getNodeContentFromREST(call,"name");
-    SQL_setSetting("lastfmSession",key);
-    SQL_setSetting("lastfmUser",name);
+    dbWriterSetSetting("lastfmSession",key);
+    dbWriterSetSetting("lastfmUser",name);
   }
   g_object_unref(call);
 }
@@ -148,34 +149,34 @@ void lastfmInit (void)
 /*
  * Submit "currently playing" to last.fm
  */
-void lastfmSubmitCurrentlyPlaying (struct trackTag currTrack)
+void lastfmSubmitCurrentlyPlaying (struct trackTag *track)
 {
   RestProxyCall *call;
 
-  if(currTrack.submittedNowPlaying || !lastfmEnabled)
+  if((g_atomic_int_get(&track->flags) & TRACK_SUBMITTED_NOW_PLAYING) || !lastfmEnabled)
   {
     return;
   }
-  if(currTrack.trackName[0] != 0 && currTrack.trackArtist[0] != 0)
+  if(track->trackName != NULL && track->trackArtist != NULL)
   {
     call = rest_proxy_new_call(lastfmConnectProxy);
     rest_proxy_call_set_function(call,"track.updateNowPlaying");
-    rest_proxy_call_add_param(call,"track",currTrack.trackName);
-    rest_proxy_call_add_param(call,"artist",currTrack.trackArtist);
+    rest_proxy_call_add_param(call,"track",track->trackName);
+    rest_proxy_call_add_param(call,"artist",track->trackArtist);
     rest_proxy_call_set_method(call,"POST");
     rest_proxy_call_async(call,(RestProxyCallAsyncCallback) lastfmRestCB,NULL,NULL,NULL);
     g_object_unref(call);
 
     // Label the current track as "now playing" submitted, so that
     // we don't resubmit if we're called again.
-    currTrack.submittedNowPlaying = true;
+    g_atomic_int_or(&track->flags,TRACK_SUBMITTED_NOW_PLAYING);
   }
 }
 
 /*
  * Submit a track playing using last.fm
  */
-void lastfmSubmitTrack (struct trackTag currTrack)
+void lastfmSubmitTrack (struct trackTag *track)
 {
   char startedPlaying[14];
   char trackLength[8];
@@ -186,31 +187,31 @@ void lastfmSubmitTrack (struct trackTag currTrack)
    */
   if(
       // We have already scrobbled
-      currTrack.scrobbled ||
+      (g_atomic_int_get(&track->flags) & TRACK_SCROBBLED) ||
       // Last.fm is disabled
       !lastfmEnabled ||
       // Track is less than 30 seconds
-      currTrack.trackLenSeconds < 30 ||
+      track->trackLenSeconds < 30 ||
       // We have no track name or track artist
-      !currTrack.hasBasicInfo
+      !track->hasBasicInfo
       )
   {
     return;
   }
 
-  if(currTrack.trackName[0] != 0 && currTrack.trackArtist[0] != 0)
+  if(track->trackName != NULL && track->trackArtist != NULL)
   {
     call = rest_proxy_new_call(lastfmConnectProxy);
     rest_proxy_call_set_function(call,"track.scrobble");
-    rest_proxy_call_add_param(call,"track",currTrack.trackName);
-    rest_proxy_call_add_param(call,"artist",currTrack.trackArtist);
-    sprintf(startedPlaying,"%d",currTrack.startedPlaying);
+    rest_proxy_call_add_param(call,"track",track->trackName);
+    rest_proxy_call_add_param(call,"artist",track->trackArtist);
+    sprintf(startedPlaying,"%d",track->startedPlaying);
     rest_proxy_call_add_param(call,"timestamp",startedPlaying);
-    sprintf(trackLength,"%d",currTrack.trackLenSeconds);
+    sprintf(trackLength,"%d",track->trackLenSeconds);
     rest_proxy_call_add_param(call,"duration",trackLength);
-    if(currTrack.hasAlbum)
+    if(track->hasAlbum)
     {
-      rest_proxy_call_add_param(call,"album",currTrack.trackAlbum);
+      rest_proxy_call_add_param(call,"album",track->trackAlbum);
     }
     rest_proxy_call_set_method(call,"POST");
     rest_proxy_call_async(call, (RestProxyCallAsyncCallback) lastfmRestCB,NULL,NULL,NULL);
@@ -218,7 +219,7 @@ void lastfmSubmitTrack (struct trackTag currTrack)
 
     // Label the current track as scrobbled, so that we don't resubmit if
     // we're called again.
-    currTrack.scrobbled = true;
+    g_atomic_int_or(&track->flags,TRACK_SCROBBLED);
   }
 }
 
@@ -5,5 +5,5 @@ void lastfmRestCB (RestProxyCall *call, const GError *error);
 char *getNodeContentFromREST (RestProxyCall *call, const char *node);
 void lastfmConnect (GtkButton *button, GtkWindow *prefsWin);
 void lastfmInit (void);
-void lastfmSubmitCurrentlyPlaying (struct trackTag currTrack);
-void lastfmSubmitTrack (struct trackTag currTrack);
+void lastfmSubmitCurrentlyPlaying (struct trackTag *track);
+void lastfmSubmitTrack (struct trackTag *track);
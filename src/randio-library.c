@@ -0,0 +1,1506 @@
+/*
+ * Randio music player
+ * Library maintenance
+ * Copyright (C) Eskild Hustvedt 2011, 2012, 2017
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#include <sqlite3.h>
+
+#include "randio-datatypes.h"
+#include "randio-sql.h"
+#include "randio-scanner.h"
+#include "randio-library.h"
+#include "randio-watcher.h"
+#include "randio-dbwriter.h"
+#include "randio-shuffle.h"
+
+/* The number of rows inserted by a single statement during scans */
+#define LIBRARY_INSERT_BATCH 64
+/* The number of tracks deleted per transaction when removing a root */
+#define LIBRARY_PURGE_CHUNK 500
+/* The number of pages freed per transaction by the vacuum after a removal */
+#define LIBRARY_VACUUM_PAGES 1000
+/* The number of roots that are scanned at the same time, see
+ * libraryQueueScan() */
+#define LIBRARY_PARALLEL_SCANS 3
+
+/* The SQL of the statements that insert one and LIBRARY_INSERT_BATCH
+ * tracks, built on first use. Only used on the database writer thread. */
+static char *insertOneSQL = NULL;
+static char *insertBatchSQL = NULL;
+
+/*
+ * Directories are stored as a tree: each row holds the name of a directory
+ * and the dir_id of its parent. The tree starts at "/", which is the only
+ * row without a parent and has an empty name. Tracks hold the dir_id of the
+ * directory they are in and their file name. Directories that have been
+ * scanned have an mtime, those that are only there as the parents of
+ * scanned ones don't.
+ */
+
+/* Prefix for statements that need the dir_id and path of ?1 (whose path is
+ * ?2) and of every directory below it, as "subtree". Stops at library roots
+ * nested below ?1, those and their tracks belong to the nested root. */
+#define LIBRARY_SUBTREE "WITH RECURSIVE subtree(dir_id, path) AS (SELECT ?1, ?2 UNION ALL " \
+  "SELECT directories.dir_id, rtrim(subtree.path,'/') || '/' || directories.name FROM directories JOIN subtree ON directories.parent_id=subtree.dir_id " \
+  "WHERE rtrim(subtree.path,'/') || '/' || directories.name NOT IN (SELECT path FROM library)) "
+
+/* Cached directory lookups, path -> dir_id and dir_id -> path. dir_ids are
+ * never reused, so a path that is cached for one is never wrong, the
+ * directory may just have been removed. */
+static GHashTable *dirIDs = NULL;
+static GHashTable *dirPaths = NULL;
+static GMutex dirCacheLock;
+
+/* Library roots that are unavailable (ie. on a disk that isn't mounted).
+ * Their tracks are left in the database but taken out of the shuffle bag
+ * until they're back. */
+static GHashTable *detachedRoots = NULL;
+static GMutex detachedLock;
+
+/* Scans that are running, so that removing a root can stop its scan */
+struct libraryRunningScan
+{
+  const char *root;
+  gint cancelled;
+};
+static GPtrArray *runningScans = NULL;
+static GMutex runningScansLock;
+/* Set by libraryShutdown(), under runningScansLock */
+static gint libraryStopping = false;
+
+/* A root waiting for, or being scanned by, libraryScanPool */
+struct libraryQueuedScan
+{
+  char *root;
+  void (*progress) (const struct libraryScanProgress *status, gpointer user_data);
+  void (*done) (gpointer user_data);
+  gpointer user_data;
+};
+static GThreadPool *libraryScanPool = NULL;
+/* The roots that are queued in libraryScanPool or being scanned by it,
+ * protected by runningScansLock */
+static GHashTable *queuedScans = NULL;
+
+/* The number of threads started by libraryThreadNew() that are still
+ * running, and of scans queued by libraryQueueScan() that haven't
+ * finished */
+static int libraryThreadCount = 0;
+static GMutex libraryThreadLock;
+static GCond libraryThreadDone;
+
+static void libraryThreadFinished (void);
+
+/*
+ * Create the directory caches if needed. dirCacheLock must be held.
+ */
+static void libraryInitDirCache (void)
+{
+  if(dirIDs == NULL)
+  {
+    dirIDs   = g_hash_table_new_full(g_str_hash,g_str_equal,free,NULL);
+    dirPaths = g_hash_table_new_full(g_direct_hash,g_direct_equal,NULL,free);
+  }
+}
+
+/*
+ * Look up path in the dir_id cache, returns -1 if it isn't there
+ */
+static int libraryCachedDirID (const char *path)
+{
+  gpointer dirID;
+  bool found;
+
+  g_mutex_lock(&dirCacheLock);
+  libraryInitDirCache();
+  found = g_hash_table_lookup_extended(dirIDs,path,NULL,&dirID);
+  g_mutex_unlock(&dirCacheLock);
+  return found ? GPOINTER_TO_INT(dirID) : -1;
+}
+
+/*
+ * Returns the dir_id of path, or -1 if it isn't in the database. If create
+ * is true it is added instead, along with any of its parents that are
+ * missing. Only the writer thread may create directories.
+ */
+static int libraryDirID (const char *path, bool create)
+{
+  sqlite3_stmt *statement;
+  const char *name = strrchr(path,'/');
+  int parentID = -1;
+  int dirID = libraryCachedDirID(path);
+
+  if(dirID != -1 || name == NULL)
+  {
+    return dirID;
+  }
+  if(name == path && path[1] == '\0')
+  {
+    // This is "/"
+    name = "";
+  }
+  else
+  {
+    char *parent = name == path ? strdup("/") : g_strndup(path,name-path);
+    parentID = libraryDirID(parent,create);
+    free(parent);
+    if(parentID == -1)
+    {
+      return -1;
+    }
+    name++;
+  }
+
+  statement = SQL_prepare("SELECT dir_id FROM directories WHERE parent_id IS ?1 AND name=?2");
+  if(parentID != -1)
+  {
+    sqlite3_bind_int(statement,1,parentID);
+  }
+  sqlite3_bind_text(statement,2,name,-1,NULL);
+  if(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    dirID = sqlite3_column_int(statement,0);
+  }
+  SQL_release(statement);
+
+  if(dirID == -1 && create)
+  {
+    statement = SQL_prepare("INSERT INTO directories (parent_id, name) VALUES (?1, ?2) RETURNING dir_id");
+    if(parentID != -1)
+    {
+      sqlite3_bind_int(statement,1,parentID);
+    }
+    sqlite3_bind_text(statement,2,name,-1,NULL);
+    if(sqlite3_step(statement) == SQLITE_ROW)
+    {
+      dirID = sqlite3_column_int(statement,0);
+    }
+    SQL_release(statement);
+  }
+
+  if(dirID != -1)
+  {
+    g_mutex_lock(&dirCacheLock);
+    g_hash_table_insert(dirIDs,strdup(path),GINT_TO_POINTER(dirID));
+    g_mutex_unlock(&dirCacheLock);
+  }
+  return dirID;
+}
+
+/*
+ * Empty the directory caches, called after directories have been removed
+ */
+static void libraryForgetDirs (void)
+{
+  g_mutex_lock(&dirCacheLock);
+  libraryInitDirCache();
+  g_hash_table_remove_all(dirIDs);
+  g_hash_table_remove_all(dirPaths);
+  g_mutex_unlock(&dirCacheLock);
+}
+
+/*
+ * Returns the full path of dirID (from the cache if possible) or NULL if
+ * it doesn't exist. The caller must free it.
+ */
+static char *libraryDirPath (int dirID)
+{
+  sqlite3_stmt *statement;
+  char *path = NULL;
+
+  g_mutex_lock(&dirCacheLock);
+  libraryInitDirCache();
+  path = g_hash_table_lookup(dirPaths,GINT_TO_POINTER(dirID));
+  path = path != NULL ? strdup(path) : NULL;
+  g_mutex_unlock(&dirCacheLock);
+  if(path != NULL)
+  {
+    return path;
+  }
+
+  // Walk up to "/", prepending the name of each directory on the way
+  statement = SQL_prepareRead("WITH RECURSIVE up(parent_id, path) AS (SELECT parent_id, name FROM directories WHERE dir_id=?1 "
+      "UNION ALL SELECT directories.parent_id, directories.name || '/' || up.path FROM directories JOIN up ON directories.dir_id=up.parent_id) "
+      "SELECT path FROM up WHERE parent_id IS NULL");
+  sqlite3_bind_int(statement,1,dirID);
+  if(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    const char *found = (const char*) sqlite3_column_text(statement,0);
+    path = strdup(*found == '\0' ? "/" : found);
+  }
+  SQL_release(statement);
+
+  if(path != NULL)
+  {
+    g_mutex_lock(&dirCacheLock);
+    g_hash_table_insert(dirPaths,GINT_TO_POINTER(dirID),strdup(path));
+    g_mutex_unlock(&dirCacheLock);
+  }
+  return path;
+}
+
+/*
+ * Returns the full path of the file name in dirID, or NULL if dirID
+ * doesn't exist. The caller must free it.
+ */
+char *libraryPath (int dirID, const char *name)
+{
+  char *dir = libraryDirPath(dirID);
+  char *path;
+
+  if(dir == NULL)
+  {
+    return NULL;
+  }
+  path = malloc(strlen(dir)+strlen(name)+2);
+  sprintf(path,"%s%s%s",dir,strcmp(dir,"/") == 0 ? "" : "/",name);
+  free(dir);
+  return path;
+}
+
+/*
+ * Returns the path of a track, or NULL if it isn't in the database (or
+ * hasn't been committed yet). The caller must free it.
+ */
+char *libraryTrackPath (int trackID)
+{
+  sqlite3_stmt *statement;
+  char *path = NULL;
+
+  statement = SQL_prepareRead("SELECT dir_id, name FROM tracks WHERE track_id=?1");
+  sqlite3_bind_int(statement,1,trackID);
+  if(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    path = libraryPath(sqlite3_column_int(statement,0),(const char*) sqlite3_column_text(statement,1));
+  }
+  SQL_release(statement);
+  return path;
+}
+
+/*
+ * Returns the full paths of every directory that has been scanned
+ */
+GPtrArray *libraryDirectories (void)
+{
+  GPtrArray *dirs = g_ptr_array_new_with_free_func(free);
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepareRead("WITH RECURSIVE tree(dir_id, path, mtime) AS (SELECT dir_id, name, mtime FROM directories WHERE parent_id IS NULL "
+      "UNION ALL SELECT directories.dir_id, tree.path || '/' || directories.name, directories.mtime FROM directories JOIN tree ON directories.parent_id=tree.dir_id) "
+      "SELECT path FROM tree WHERE mtime IS NOT NULL");
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    const char *path = (const char*) sqlite3_column_text(statement,0);
+    g_ptr_array_add(dirs,strdup(*path == '\0' ? "/" : path));
+  }
+  SQL_release(statement);
+  return dirs;
+}
+
+/*
+ * Load the directories below (and including) root that were seen during the
+ * previous scan. Returns a hash table suitable for scannerStart()
+ */
+static GHashTable *libraryLoadDirIndex (const char *root)
+{
+  GHashTable *index = g_hash_table_new_full(g_str_hash,g_str_equal,free,(GDestroyNotify) scannerFreeIndexEntry);
+  GHashTableIter iter;
+  gpointer key;
+  sqlite3_stmt *statement;
+  int rootID = libraryDirID(root,false);
+
+  if(rootID == -1)
+  {
+    return index;
+  }
+
+  statement = SQL_prepare("WITH RECURSIVE tree(dir_id, path, mtime, inode) AS (SELECT dir_id, ?2, mtime, inode FROM directories WHERE dir_id=?1 "
+      "UNION ALL SELECT directories.dir_id, tree.path || '/' || directories.name, directories.mtime, directories.inode FROM directories JOIN tree ON directories.parent_id=tree.dir_id) "
+      "SELECT path, mtime, inode FROM tree WHERE mtime IS NOT NULL");
+  sqlite3_bind_int(statement,1,rootID);
+  sqlite3_bind_text(statement,2,root,-1,NULL);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    struct randioScanIndexEntry *entry = malloc(sizeof(struct randioScanIndexEntry));
+    entry->mtime    = sqlite3_column_int64(statement,1);
+    entry->inode    = sqlite3_column_int64(statement,2);
+    entry->children = g_ptr_array_new_with_free_func(free);
+    g_hash_table_insert(index,strdup((const char*) sqlite3_column_text(statement,0)),entry);
+  }
+  SQL_release(statement);
+
+  // Let each directory know about its subdirectories
+  g_hash_table_iter_init(&iter,index);
+  while(g_hash_table_iter_next(&iter,&key,NULL))
+  {
+    const char *path = key;
+    const char *name = strrchr(path,'/');
+    struct randioScanIndexEntry *parent;
+    char *parentPath;
+
+    if(name == NULL || strcmp(path,root) == 0)
+      continue;
+
+    parentPath = g_strndup(path,name-path);
+    parent     = g_hash_table_lookup(index,parentPath);
+    if(parent != NULL)
+    {
+      g_ptr_array_add(parent->children,strdup(name+1));
+    }
+    g_free(parentPath);
+  }
+  return index;
+}
+
+/*
+ * Delete a single track
+ */
+static void libraryDeleteTrack (int trackID)
+{
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepare("DELETE FROM loved WHERE track_id=?1");
+  sqlite3_bind_int(statement, 1, trackID);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  statement = SQL_prepare("DELETE FROM failures WHERE track_id=?1");
+  sqlite3_bind_int(statement, 1, trackID);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  statement = SQL_prepare("DELETE FROM tags WHERE track_id=?1");
+  sqlite3_bind_int(statement, 1, trackID);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  statement = SQL_prepare("DELETE FROM tracks WHERE track_id=?1");
+  sqlite3_bind_int(statement, 1, trackID);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  shuffleForgetTrack(trackID);
+}
+
+/*
+ * Remove tracks that were in dir during the last scan, but are no longer
+ * among the files that are in it now
+ */
+static void libraryRemoveVanishedFiles (int dirID, struct randioScanDir *dir)
+{
+  GHashTable *present = g_hash_table_new(g_str_hash,g_str_equal);
+  GArray *vanished    = g_array_new(FALSE,FALSE,sizeof(int));
+  sqlite3_stmt *statement;
+
+  for(guint i = 0; i < dir->files->len; i++)
+  {
+    const char *file = g_ptr_array_index(dir->files,i);
+    g_hash_table_add(present,(gpointer) (strrchr(file,'/')+1));
+  }
+
+  statement = SQL_prepare("SELECT track_id, name FROM tracks WHERE dir_id=?1");
+  sqlite3_bind_int(statement,1,dirID);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    if(!g_hash_table_contains(present,sqlite3_column_text(statement,1)))
+    {
+      int trackID = sqlite3_column_int(statement,0);
+      g_array_append_val(vanished,trackID);
+    }
+  }
+  SQL_release(statement);
+
+  for(guint i = 0; i < vanished->len; i++)
+  {
+    libraryDeleteTrack(g_array_index(vanished,int,i));
+  }
+
+  g_array_free(vanished,TRUE);
+  g_hash_table_destroy(present);
+}
+
+/*
+ * Returns the library root that path is in (or is), or NULL if it isn't in
+ * one. The caller must free it.
+ */
+static char *libraryRootOf (const char *path)
+{
+  sqlite3_stmt *statement;
+  char *root = NULL;
+
+  statement = SQL_prepare("SELECT path FROM library WHERE path=?1 OR substr(?1,1,length(path)+1) = path || '/' ORDER BY length(path) DESC LIMIT 1");
+  sqlite3_bind_text(statement,1,path,-1,NULL);
+  if(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    root = strdup((const char*) sqlite3_column_text(statement,0));
+  }
+  SQL_release(statement);
+  return root;
+}
+
+/*
+ * Remove a directory that no longer exists, along with every directory and
+ * track below it, except for library roots nested below it. Runs on the
+ * writer thread.
+ */
+static void libraryRemoveDir (const char *path)
+{
+  sqlite3_stmt *statement;
+  int dirID = libraryDirID(path,false);
+  char *root;
+
+  // Already gone along with one of its parents
+  if(dirID == -1)
+  {
+    return;
+  }
+  // A nested root that has gone away is up to its own scan, which detaches
+  // it rather than throwing its tracks away
+  root = libraryRootOf(path);
+  if(root != NULL && strcmp(root,path) == 0)
+  {
+    free(root);
+    return;
+  }
+  free(root);
+
+  statement = SQL_prepare(LIBRARY_SUBTREE "DELETE FROM loved WHERE track_id IN (SELECT track_id FROM tracks WHERE dir_id IN (SELECT dir_id FROM subtree))");
+  sqlite3_bind_int(statement,1,dirID);
+  sqlite3_bind_text(statement,2,path,-1,NULL);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  statement = SQL_prepare(LIBRARY_SUBTREE "DELETE FROM failures WHERE track_id IN (SELECT track_id FROM tracks WHERE dir_id IN (SELECT dir_id FROM subtree))");
+  sqlite3_bind_int(statement,1,dirID);
+  sqlite3_bind_text(statement,2,path,-1,NULL);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  statement = SQL_prepare(LIBRARY_SUBTREE "DELETE FROM tags WHERE track_id IN (SELECT track_id FROM tracks WHERE dir_id IN (SELECT dir_id FROM subtree))");
+  sqlite3_bind_int(statement,1,dirID);
+  sqlite3_bind_text(statement,2,path,-1,NULL);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  statement = SQL_prepare(LIBRARY_SUBTREE "DELETE FROM tracks WHERE dir_id IN (SELECT dir_id FROM subtree) RETURNING track_id");
+  sqlite3_bind_int(statement,1,dirID);
+  sqlite3_bind_text(statement,2,path,-1,NULL);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    shuffleForgetTrack(sqlite3_column_int(statement,0));
+  }
+  SQL_release(statement);
+
+  // The directories leading down to a nested root have to stay, but they
+  // are no longer scanned
+  statement = SQL_prepare(LIBRARY_SUBTREE "UPDATE directories SET mtime=NULL, inode=NULL WHERE dir_id IN (SELECT dir_id FROM subtree)");
+  sqlite3_bind_int(statement,1,dirID);
+  sqlite3_bind_text(statement,2,path,-1,NULL);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  statement = SQL_prepare(LIBRARY_SUBTREE "DELETE FROM directories WHERE dir_id IN (SELECT dir_id FROM subtree "
+      "WHERE NOT EXISTS (SELECT 1 FROM library WHERE substr(library.path,1,length(rtrim(subtree.path,'/'))+1) = rtrim(subtree.path,'/') || '/'))");
+  sqlite3_bind_int(statement,1,dirID);
+  sqlite3_bind_text(statement,2,path,-1,NULL);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  libraryForgetDirs();
+}
+
+/*
+ * Clear the missing flag on tracks directly within dirID, which has just
+ * been listed. Runs on the writer thread.
+ */
+static void libraryFoundMissing (int dirID)
+{
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepare("UPDATE tracks SET missing=0 WHERE dir_id=?1 AND missing=1 AND banned != 1 "
+      "RETURNING track_id, track_id IN (SELECT track_id FROM loved), skips");
+  sqlite3_bind_int(statement,1,dirID);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    shuffleRestore(sqlite3_column_int(statement,0),sqlite3_column_int(statement,1),sqlite3_column_int(statement,2));
+  }
+  SQL_release(statement);
+}
+
+/*
+ * A directory that has been scanned, waiting to be stored by the writer
+ */
+struct libraryDirUpdate
+{
+  struct randioScanDir *dir;
+  /* true if the directory was seen by the previous scan */
+  bool known;
+};
+
+static void libraryFreeDirUpdate (struct libraryDirUpdate *update)
+{
+  scannerFreeDir(update->dir);
+  free(update);
+}
+
+/*
+ * Store the result of scanning a single directory. Runs on the writer thread.
+ */
+static void libraryUpdateDir (struct libraryDirUpdate *update)
+{
+  struct randioScanDir *dir = update->dir;
+  sqlite3_stmt *statement;
+  char *root = libraryRootOf(dir->path);
+  int dirID;
+
+  // The root was removed while it was being scanned, and its tracks are
+  // being (or have been) purged
+  if(root == NULL)
+  {
+    return;
+  }
+  free(root);
+
+  dirID = libraryDirID(dir->path,true);
+  if(dirID == -1)
+  {
+    printf("Unable to store the directory %s\n",dir->path);
+    return;
+  }
+
+  // Record the mtime so that the next scan can skip it if it's unchanged
+  statement = SQL_prepare("UPDATE directories SET mtime=?2, inode=?3 WHERE dir_id=?1");
+  sqlite3_bind_int(statement,1,dirID);
+  sqlite3_bind_int64(statement,2,dir->mtime);
+  sqlite3_bind_int64(statement,3,dir->inode);
+  sqlite3_step(statement);
+  SQL_release(statement);
+
+  if(!dir->listed)
+  {
+    return;
+  }
+
+  addFilesToLib(dir->files);
+
+  // Nothing can have vanished from a directory we've never seen before, and
+  // nothing in it can have gone missing
+  if(update->known)
+  {
+    libraryRemoveVanishedFiles(dirID,dir);
+    // Anything directly in it that had gone missing is back
+    libraryFoundMissing(dirID);
+  }
+}
+
+/*
+ * Returns true if root can be read. An empty root that we know has tracks
+ * is most likely a mount point without anything mounted on it, so that
+ * counts as unreadable.
+ */
+static bool libraryRootReadable (const char *root)
+{
+  sqlite3_stmt *statement;
+  GDir *dir = g_dir_open(root,0,NULL);
+  bool empty;
+  bool hasTracks = false;
+
+  if(dir == NULL)
+  {
+    return false;
+  }
+  empty = g_dir_read_name(dir) == NULL;
+  g_dir_close(dir);
+  if(!empty)
+  {
+    return true;
+  }
+
+  statement = SQL_prepare(LIBRARY_SUBTREE "SELECT 1 FROM tracks WHERE dir_id IN (SELECT dir_id FROM subtree) LIMIT 1");
+  sqlite3_bind_int(statement,1,libraryDirID(root,false));
+  sqlite3_bind_text(statement,2,root,-1,NULL);
+  hasTracks = sqlite3_step(statement) == SQLITE_ROW;
+  SQL_release(statement);
+  return !hasTracks;
+}
+
+/*
+ * Take the tracks below root out of the shuffle bag. Runs on the writer
+ * thread.
+ */
+static void libraryApplyDetach (const char *root)
+{
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepare(LIBRARY_SUBTREE "SELECT track_id FROM tracks WHERE dir_id IN (SELECT dir_id FROM subtree)");
+  sqlite3_bind_int(statement,1,libraryDirID(root,false));
+  sqlite3_bind_text(statement,2,root,-1,NULL);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    shuffleForgetTrack(sqlite3_column_int(statement,0));
+  }
+  SQL_release(statement);
+}
+
+/*
+ * Put the tracks below root back into the shuffle bag, skipping those that
+ * shuffleInit() would have. Runs on the writer thread.
+ */
+static void libraryApplyAttach (const char *root)
+{
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepare(LIBRARY_SUBTREE "SELECT track_id, track_id IN (SELECT track_id FROM loved), skips FROM tracks WHERE dir_id IN (SELECT dir_id FROM subtree) "
+      "AND banned != 1 AND missing != 1 AND track_id NOT IN (SELECT track_id FROM failures WHERE retry_after > strftime('%s','now'))");
+  sqlite3_bind_int(statement,1,libraryDirID(root,false));
+  sqlite3_bind_text(statement,2,root,-1,NULL);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    shuffleRestore(sqlite3_column_int(statement,0),sqlite3_column_int(statement,1),sqlite3_column_int(statement,2));
+  }
+  SQL_release(statement);
+}
+
+/*
+ * Detach or attach root. Returns true if that changed anything.
+ */
+static bool librarySetDetached (const char *root, bool detached)
+{
+  bool changed;
+
+  g_mutex_lock(&detachedLock);
+  if(detachedRoots == NULL)
+  {
+    detachedRoots = g_hash_table_new_full(g_str_hash,g_str_equal,free,NULL);
+  }
+  changed = g_hash_table_contains(detachedRoots,root) != detached;
+  if(changed && detached)
+  {
+    g_hash_table_add(detachedRoots,strdup(root));
+  }
+  else if(changed)
+  {
+    g_hash_table_remove(detachedRoots,root);
+  }
+  g_mutex_unlock(&detachedLock);
+
+  if(changed)
+  {
+    dbWriterPost((void (*) (gpointer)) (detached ? libraryApplyDetach : libraryApplyAttach),strdup(root),free);
+  }
+  return changed;
+}
+
+/*
+ * Returns false if the library root that path is in is unavailable, in
+ * which case path being unreadable says nothing about path itself. Roots
+ * that turn out to be unavailable are detached, which is a lot quicker
+ * than finding out that their tracks are missing one at a time.
+ */
+bool libraryPathAvailable (const char *path)
+{
+  char *root = libraryRootOf(path);
+  bool available = true;
+
+  if(root == NULL)
+  {
+    return true;
+  }
+  g_mutex_lock(&detachedLock);
+  available = detachedRoots == NULL || !g_hash_table_contains(detachedRoots,root);
+  g_mutex_unlock(&detachedLock);
+
+  if(available && !libraryRootReadable(root))
+  {
+    if(librarySetDetached(root,true))
+    {
+      printf("%s is unavailable, leaving its tracks out until it is back\n",root);
+    }
+    available = false;
+  }
+  free(root);
+  return available;
+}
+
+/*
+ * Rescan the detached roots that have become available again, which
+ * attaches them. Should be called every now and then from a thread.
+ */
+void libraryRetryDetachedRoots (void)
+{
+  GPtrArray *roots = g_ptr_array_new_with_free_func(free);
+  GHashTableIter iter;
+  gpointer key;
+
+  g_mutex_lock(&detachedLock);
+  if(detachedRoots != NULL)
+  {
+    g_hash_table_iter_init(&iter,detachedRoots);
+    while(g_hash_table_iter_next(&iter,&key,NULL))
+    {
+      g_ptr_array_add(roots,strdup(key));
+    }
+  }
+  g_mutex_unlock(&detachedLock);
+
+  for(guint i = 0; i < roots->len; i++)
+  {
+    if(libraryRootReadable(g_ptr_array_index(roots,i)))
+    {
+      libraryScan(g_ptr_array_index(roots,i),NULL,NULL);
+    }
+  }
+  g_ptr_array_free(roots,TRUE);
+}
+
+/*
+ * Returns true if path, or one of the directories above it, is in dirs
+ */
+static bool libraryWithinAny (GHashTable *dirs, const char *path)
+{
+  char *parent;
+  char *slash;
+  bool within = false;
+
+  if(g_hash_table_size(dirs) == 0)
+  {
+    return false;
+  }
+  parent = strdup(path);
+  while(!within && parent[0] != '\0')
+  {
+    within = g_hash_table_contains(dirs,parent);
+    slash  = strrchr(parent,'/');
+    if(slash == NULL)
+    {
+      break;
+    }
+    *slash = '\0';
+  }
+  free(parent);
+  return within;
+}
+
+/*
+ * Scan (or rescan) root, adding new tracks and removing those that no longer
+ * exist. Directories that are unchanged since the last scan are skipped.
+ * progress, if not NULL, is called once for every directory visited, in
+ * the thread that called libraryScan.
+ *
+ * The results are stored by the database writer thread, so any number of
+ * scans can run at the same time. Blocks until the scan is done and
+ * everything has been committed, so it should be run in a thread.
+ */
+void libraryScan (const char *root, void (*progress) (const struct libraryScanProgress *status, gpointer user_data), gpointer user_data)
+{
+  struct libraryScanProgress status = { 0, 0, 0 };
+  struct libraryRunningScan scan = { root, 0 };
+  struct randioScanner *scanner;
+  struct randioScanDir *dir;
+  GHashTable *index;
+  GHashTable *visited;
+  GHashTable *unreadable;
+  GHashTableIter iter;
+  gpointer key;
+  char *libraryRoot = libraryRootOf(root);
+
+  // Only library roots are detached, a subdirectory that can't be read is
+  // handled by scanning its parent
+  if(libraryRoot != NULL && strcmp(libraryRoot,root) != 0)
+  {
+    free(libraryRoot);
+    libraryRoot = NULL;
+  }
+  if(libraryRoot != NULL && !libraryRootReadable(root))
+  {
+    if(librarySetDetached(root,true))
+    {
+      printf("%s is unavailable, leaving its tracks out until it is back\n",root);
+    }
+    free(libraryRoot);
+    return;
+  }
+
+  index   = libraryLoadDirIndex(root);
+  visited = g_hash_table_new_full(g_str_hash,g_str_equal,free,NULL);
+  unreadable = g_hash_table_new_full(g_str_hash,g_str_equal,free,NULL);
+
+  g_mutex_lock(&runningScansLock);
+  if(runningScans == NULL)
+  {
+    runningScans = g_ptr_array_new();
+  }
+  g_ptr_array_add(runningScans,&scan);
+  scan.cancelled = g_atomic_int_get(&libraryStopping);
+  g_mutex_unlock(&runningScansLock);
+
+  // The directory tree is walked by the scanner's worker threads, we
+  // consume the directories it visits and store the results
+  scanner = scannerStart(root,index);
+  while( (dir = scannerNextDir(scanner)) != NULL )
+  {
+    struct libraryDirUpdate *update;
+
+    // Drain whatever the workers had already found
+    if(g_atomic_int_get(&scan.cancelled))
+    {
+      scannerCancel(scanner);
+      scannerFreeDir(dir);
+      continue;
+    }
+
+    // Only a directory that doesn't exist any more is gone. Anything else
+    // (permissions, I/O errors, a share timing out) may well be fine next
+    // time, so everything below it is left alone.
+    if(dir->error != 0)
+    {
+      if(dir->error != ENOENT && dir->error != ENOTDIR)
+      {
+        printf("Unable to read %s (%s), leaving its tracks alone\n",dir->path,strerror(dir->error));
+        g_hash_table_add(unreadable,strdup(dir->path));
+      }
+      scannerFreeDir(dir);
+      continue;
+    }
+
+    update = malloc(sizeof(struct libraryDirUpdate));
+    g_hash_table_add(visited,strdup(dir->path));
+    if(progress != NULL)
+    {
+      status.dirsScanned++;
+      status.filesFound += dir->files->len;
+      // The scanner only knows about the directories it has found so far,
+      // the previous scan knows roughly how many there are in total
+      status.dirsLeft = MAX(scannerPending(scanner),(int) g_hash_table_size(index)-status.dirsScanned);
+      progress(&status,user_data);
+    }
+    watcherAddDirectory(dir->path);
+
+    // The writer takes ownership of dir
+    update->dir   = dir;
+    update->known = g_hash_table_contains(index,dir->path);
+    dbWriterPostRows((void (*) (gpointer)) libraryUpdateDir,update,(GDestroyNotify) libraryFreeDirUpdate, 1+dir->files->len);
+  }
+
+  g_mutex_lock(&runningScansLock);
+  g_ptr_array_remove_fast(runningScans,&scan);
+  g_mutex_unlock(&runningScansLock);
+
+  /*
+   * Anything that was in the index but that we didn't visit this time is
+   * gone, unless it is below a directory we couldn't read. If we couldn't
+   * read the root at all it is most likely an unmounted disk or share, and
+   * we leave everything alone.
+   */
+  if(g_atomic_int_get(&scan.cancelled))
+  {
+    printf("Stopped scanning %s\n",root);
+  }
+  else if(g_hash_table_contains(visited,root))
+  {
+    g_hash_table_iter_init(&iter,index);
+    while(g_hash_table_iter_next(&iter,&key,NULL))
+    {
+      if(!g_hash_table_contains(visited,key) && !libraryWithinAny(unreadable,key))
+      {
+        dbWriterPost((void (*) (gpointer)) libraryRemoveDir,strdup(key),free);
+      }
+    }
+    if(libraryRoot != NULL)
+    {
+      librarySetDetached(root,false);
+    }
+  }
+  else if(libraryRoot != NULL)
+  {
+    printf("Unable to read %s, leaving its tracks out until it is back\n",root);
+    librarySetDetached(root,true);
+  }
+  else
+  {
+    printf("Unable to read %s, leaving its tracks alone\n",root);
+  }
+  free(libraryRoot);
+
+  scannerFinish(scanner);
+  g_hash_table_destroy(unreadable);
+  g_hash_table_destroy(visited);
+  g_hash_table_destroy(index);
+
+  dbWriterSync();
+}
+
+/*
+ * Runs a scan queued by libraryQueueScan(), in libraryScanPool
+ */
+static void libraryScanRoot (struct libraryQueuedScan *queued, gpointer user_data)
+{
+  if(!g_atomic_int_get(&libraryStopping))
+  {
+    libraryScan(queued->root,queued->progress,queued->user_data);
+  }
+  g_mutex_lock(&runningScansLock);
+  g_hash_table_remove(queuedScans,queued->root);
+  g_mutex_unlock(&runningScansLock);
+  if(queued->done != NULL)
+  {
+    queued->done(queued->user_data);
+  }
+  free(queued->root);
+  free(queued);
+  libraryThreadFinished();
+}
+
+/*
+ * Scan root in the background. Roots are scanned in parallel, so that a
+ * slow disk or share doesn't hold up the others, but only
+ * LIBRARY_PARALLEL_SCANS at a time since each scan has a worker per core of
+ * its own. Their results all go through the writer. progress is passed on
+ * to libraryScan, and done (if not NULL) is called once the scan has
+ * finished, both on the scanning thread.
+ *
+ * Returns false, without calling either, if root is already queued or
+ * being scanned, or if we're shutting down.
+ */
+bool libraryQueueScan (const char *root, void (*progress) (const struct libraryScanProgress *status, gpointer user_data), void (*done) (gpointer user_data), gpointer user_data)
+{
+  struct libraryQueuedScan *queued;
+
+  g_mutex_lock(&libraryThreadLock);
+  g_mutex_lock(&runningScansLock);
+  if(g_atomic_int_get(&libraryStopping) || (queuedScans != NULL && g_hash_table_contains(queuedScans,root)))
+  {
+    g_mutex_unlock(&runningScansLock);
+    g_mutex_unlock(&libraryThreadLock);
+    return false;
+  }
+  if(queuedScans == NULL)
+  {
+    queuedScans     = g_hash_table_new_full(g_str_hash,g_str_equal,free,NULL);
+    libraryScanPool = g_thread_pool_new((GFunc) libraryScanRoot,NULL,LIBRARY_PARALLEL_SCANS,FALSE,NULL);
+  }
+  g_hash_table_add(queuedScans,strdup(root));
+  // So that libraryShutdown() waits for it
+  libraryThreadCount++;
+  g_mutex_unlock(&runningScansLock);
+  g_mutex_unlock(&libraryThreadLock);
+
+  queued            = malloc(sizeof(struct libraryQueuedScan));
+  queued->root      = strdup(root);
+  queued->progress  = progress;
+  queued->done      = done;
+  queued->user_data = user_data;
+  g_thread_pool_push(libraryScanPool,queued,NULL);
+  return true;
+}
+
+/*
+ * The scans queued by a libraryRescanAll() that haven't finished yet
+ */
+struct libraryRescan
+{
+  int pending;
+  GMutex lock;
+  GCond finished;
+};
+
+static void libraryRescanDone (struct libraryRescan *rescan)
+{
+  g_mutex_lock(&rescan->lock);
+  rescan->pending--;
+  g_cond_signal(&rescan->finished);
+  g_mutex_unlock(&rescan->lock);
+}
+
+/*
+ * Rescan every directory in the library, and wait for it to finish. Roots
+ * that are already being scanned are left to that scan.
+ */
+void libraryRescanAll (void)
+{
+  struct libraryRescan rescan;
+  sqlite3_stmt *statement;
+
+  rescan.pending = 0;
+  g_mutex_init(&rescan.lock);
+  g_cond_init(&rescan.finished);
+
+  g_mutex_lock(&rescan.lock);
+  statement = SQL_prepareRead("SELECT path FROM library");
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    if(libraryQueueScan((const char*) sqlite3_column_text(statement,0),NULL,(void (*) (gpointer)) libraryRescanDone,&rescan))
+    {
+      rescan.pending++;
+    }
+  }
+  SQL_release(statement);
+  while(rescan.pending > 0)
+  {
+    g_cond_wait(&rescan.finished,&rescan.lock);
+  }
+  g_mutex_unlock(&rescan.lock);
+
+  g_cond_clear(&rescan.finished);
+  g_mutex_clear(&rescan.lock);
+}
+
+/*
+ * Runs libraryRescanAll in a thread
+ */
+void libraryRescanInBackground (void)
+{
+  libraryThreadNew("libraryRescan", (GThreadFunc) libraryRescanAll,NULL);
+}
+
+/*
+ * A library root whose tracks are being removed
+ */
+struct libraryPurge
+{
+  char *root;
+  /* The number of tracks deleted by the last chunk */
+  int deleted;
+  /* The number of free pages left in the database */
+  int freePages;
+};
+
+/*
+ * Delete up to LIBRARY_PURGE_CHUNK of the tracks below purge->root. Runs on
+ * the writer thread.
+ */
+static void libraryPurgeChunk (struct libraryPurge *purge)
+{
+  GArray *tracks = g_array_new(FALSE,FALSE,sizeof(int));
+  sqlite3_stmt *statement;
+  int dirID = libraryDirID(purge->root,false);
+
+  if(dirID != -1)
+  {
+    statement = SQL_prepare(LIBRARY_SUBTREE "SELECT track_id FROM tracks WHERE dir_id IN (SELECT dir_id FROM subtree) LIMIT ?3");
+    sqlite3_bind_int(statement,1,dirID);
+    sqlite3_bind_text(statement,2,purge->root,-1,NULL);
+    sqlite3_bind_int(statement,3,LIBRARY_PURGE_CHUNK);
+    while(sqlite3_step(statement) == SQLITE_ROW)
+    {
+      int trackID = sqlite3_column_int(statement,0);
+      g_array_append_val(tracks,trackID);
+    }
+    SQL_release(statement);
+  }
+
+  for(guint i = 0; i < tracks->len; i++)
+  {
+    libraryDeleteTrack(g_array_index(tracks,int,i));
+  }
+  purge->deleted = tracks->len;
+  g_array_free(tracks,TRUE);
+}
+
+/*
+ * Give up to LIBRARY_VACUUM_PAGES free pages back to the filesystem. Runs
+ * on the writer thread.
+ */
+static void libraryVacuumChunk (struct libraryPurge *purge)
+{
+  sqlite3_stmt *statement;
+
+  // Frees one page per step
+  statement = SQL_prepare("PRAGMA incremental_vacuum(" G_STRINGIFY(LIBRARY_VACUUM_PAGES) ")");
+  while(sqlite3_step(statement) == SQLITE_ROW)
+    ;
+  SQL_release(statement);
+
+  statement = SQL_prepare("PRAGMA freelist_count");
+  sqlite3_step(statement);
+  purge->freePages = sqlite3_column_int(statement,0);
+  SQL_release(statement);
+}
+
+/*
+ * Returns true if root is (again) in the library, or below one of the roots
+ * that are, in which case its tracks are still wanted
+ */
+static bool libraryWithinRoot (const char *root)
+{
+  sqlite3_stmt *statement;
+  bool within;
+
+  statement = SQL_prepare("SELECT 1 FROM library WHERE path = ?1 OR substr(?1,1,length(path)+1) = path || '/'");
+  sqlite3_bind_text(statement,1,root,-1,NULL);
+  within = sqlite3_step(statement) == SQLITE_ROW;
+  SQL_release(statement);
+  return within;
+}
+
+/*
+ * Returns the roots in the library that are below root
+ */
+static GPtrArray *libraryNestedRoots (const char *root)
+{
+  GPtrArray *nested = g_ptr_array_new_with_free_func(free);
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepareRead("SELECT path FROM library WHERE substr(path,1,length(?1)+1) = ?1 || '/'");
+  sqlite3_bind_text(statement,1,root,-1,NULL);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    g_ptr_array_add(nested,strdup((const char*) sqlite3_column_text(statement,0)));
+  }
+  SQL_release(statement);
+  return nested;
+}
+
+/*
+ * Removes the tracks below a root that has been removed from the library.
+ * This is done a chunk at a time, committing after each one, so that the
+ * writer is never held up for long and other writes go through in between.
+ * Stops between chunks if we're shutting down, libraryResumePurges() picks
+ * it up again on the next start. Runs in its own thread.
+ */
+static gpointer libraryPurgeRoot (char *root)
+{
+  struct libraryPurge purge = { root, 0, 0 };
+  int removed = 0;
+  int freePages;
+
+  dbWriterSync();
+  if(!libraryWithinRoot(root))
+  {
+    GPtrArray *nested = libraryNestedRoots(root);
+    // Changes below it are of no interest any more
+    watcherRemoveRoot(root,nested);
+    g_ptr_array_free(nested,TRUE);
+
+    do
+    {
+      dbWriterPost((void (*) (gpointer)) libraryPurgeChunk,&purge,NULL);
+      dbWriterSync();
+      removed += purge.deleted;
+    } while(purge.deleted > 0 && !g_atomic_int_get(&libraryStopping));
+
+    if(purge.deleted > 0)
+    {
+      printf("Removed %d tracks of %s from the library, the rest are removed on the next start\n",removed,root);
+      free(root);
+      return NULL;
+    }
+
+    // What is left is the directories themselves
+    dbWriterPost((void (*) (gpointer)) libraryRemoveDir,root,NULL);
+    // Stops early if nothing is freed, which is what happens if the
+    // database isn't using auto_vacuum=INCREMENTAL
+    do
+    {
+      freePages = purge.freePages;
+      dbWriterPost((void (*) (gpointer)) libraryVacuumChunk,&purge,NULL);
+      dbWriterSync();
+    } while(purge.freePages > 0 && purge.freePages != freePages && !g_atomic_int_get(&libraryStopping));
+  }
+  dbWriterExecText("DELETE FROM purges WHERE path=?1",root);
+  printf("Removed %s and its %d tracks from the library\n",root,removed);
+  free(root);
+  return NULL;
+}
+
+/*
+ * Stop the scans of root that are running, or all of them if root is NULL.
+ * Whatever they have already found is dropped by the writer, since root is
+ * no longer in the library.
+ */
+static void libraryCancelScans (const char *root)
+{
+  g_mutex_lock(&runningScansLock);
+  if(runningScans != NULL)
+  {
+    for(guint i = 0; i < runningScans->len; i++)
+    {
+      struct libraryRunningScan *scan = g_ptr_array_index(runningScans,i);
+      if(root == NULL || strcmp(scan->root,root) == 0)
+      {
+        g_atomic_int_set(&scan->cancelled,1);
+      }
+    }
+  }
+  g_mutex_unlock(&runningScansLock);
+}
+
+/*
+ * Removes root from the library, along with all of its tracks. The tracks
+ * are removed in the background.
+ */
+void libraryRemoveRoot (const char *root)
+{
+  char *purge = strdup(root);
+
+  dbWriterExecText("DELETE FROM library WHERE path=?1",root);
+  // Remembered until all of its tracks are gone, in case we quit before
+  dbWriterExecText("INSERT OR IGNORE INTO purges (path) VALUES (?1)",root);
+  libraryCancelScans(root);
+  g_mutex_lock(&detachedLock);
+  if(detachedRoots != NULL)
+  {
+    g_hash_table_remove(detachedRoots,root);
+  }
+  g_mutex_unlock(&detachedLock);
+  if(!libraryThreadNew("libraryPurge", (GThreadFunc) libraryPurgeRoot,purge))
+  {
+    free(purge);
+  }
+}
+
+/*
+ * Carry on removing the tracks of the roots that were being removed when
+ * we last quit. Called during startup.
+ */
+void libraryResumePurges (void)
+{
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepareRead("SELECT path FROM purges");
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    char *root = strdup((const char*) sqlite3_column_text(statement,0));
+    if(!libraryThreadNew("libraryPurge", (GThreadFunc) libraryPurgeRoot,root))
+    {
+      free(root);
+    }
+  }
+  SQL_release(statement);
+}
+
+/*
+ * Runs a thread started by libraryThreadNew()
+ */
+struct libraryThread
+{
+  GThreadFunc func;
+  gpointer data;
+};
+
+static gpointer libraryThreadRun (struct libraryThread *thread)
+{
+  thread->func(thread->data);
+  free(thread);
+  libraryThreadFinished();
+  return NULL;
+}
+
+/*
+ * Called when a thread started by libraryThreadNew(), or a scan queued by
+ * libraryQueueScan(), has finished
+ */
+static void libraryThreadFinished (void)
+{
+  g_mutex_lock(&libraryThreadLock);
+  libraryThreadCount--;
+  g_cond_broadcast(&libraryThreadDone);
+  g_mutex_unlock(&libraryThreadLock);
+}
+
+/*
+ * Run func in a thread of its own, which libraryShutdown() waits for. For
+ * anything that scans or writes to the library in the background. Returns
+ * false, without running it, once we're shutting down.
+ */
+bool libraryThreadNew (const char *name, GThreadFunc func, gpointer data)
+{
+  struct libraryThread *thread;
+
+  g_mutex_lock(&libraryThreadLock);
+  if(g_atomic_int_get(&libraryStopping))
+  {
+    g_mutex_unlock(&libraryThreadLock);
+    return false;
+  }
+  libraryThreadCount++;
+  g_mutex_unlock(&libraryThreadLock);
+
+  thread       = malloc(sizeof(struct libraryThread));
+  thread->func = func;
+  thread->data = data;
+  g_thread_unref( g_thread_new(name, (GThreadFunc) libraryThreadRun,thread) );
+  return true;
+}
+
+/*
+ * Stop every scan and purge, and wait for the threads started by
+ * libraryThreadNew() and the scans queued by libraryQueueScan() to finish. Called during shutdown, while the validator
+ * and the database writer are still running.
+ */
+void libraryShutdown (void)
+{
+  g_mutex_lock(&libraryThreadLock);
+  g_mutex_lock(&runningScansLock);
+  g_atomic_int_set(&libraryStopping,true);
+  g_mutex_unlock(&runningScansLock);
+  g_mutex_unlock(&libraryThreadLock);
+  libraryCancelScans(NULL);
+
+  g_mutex_lock(&libraryThreadLock);
+  while(libraryThreadCount > 0)
+  {
+    g_cond_wait(&libraryThreadDone,&libraryThreadLock);
+  }
+  g_mutex_unlock(&libraryThreadLock);
+}
+
+/*
+ * Returns the dir_id of the directory file is in, creating it if needed,
+ * and points name at its file name. Returns -1 if file isn't an absolute
+ * path. Writer thread only.
+ */
+static int libraryFileDir (const char *file, const char **name)
+{
+  const char *slash = strrchr(file,'/');
+  char *dir;
+  int dirID;
+
+  if(slash == NULL)
+  {
+    return -1;
+  }
+  *name = slash+1;
+  dir   = slash == file ? strdup("/") : g_strndup(file,slash-file);
+  dirID = libraryDirID(dir,true);
+  free(dir);
+  return dirID;
+}
+
+/*
+ * Binds file as the index'th (from 0) row of an insert statement
+ */
+static bool libraryBindFile (sqlite3_stmt *statement, int index, const char *file)
+{
+  const char *name;
+  int dirID = libraryFileDir(file,&name);
+
+  if(dirID == -1)
+  {
+    printf("Ignoring %s, it isn't an absolute path\n",file);
+    return false;
+  }
+  sqlite3_bind_int(statement,index*2+1,dirID);
+  sqlite3_bind_text(statement,index*2+2,name,-1,SQLITE_STATIC);
+  return true;
+}
+
+/*
+ * Returns a statement that inserts rows paths at once, release it with
+ * SQL_release(). It returns the track_id of every track that was actually
+ * added.
+ */
+static sqlite3_stmt *libraryInsertStatement (int rows)
+{
+  char **SQL = rows == 1 ? &insertOneSQL : &insertBatchSQL;
+  GString *insert;
+
+  if(*SQL == NULL)
+  {
+    insert = g_string_new("INSERT OR IGNORE INTO tracks (dir_id, name) VALUES (?,?)");
+    for(int i = 1; i < rows; i++)
+    {
+      g_string_append(insert,",(?,?)");
+    }
+    g_string_append(insert," RETURNING track_id");
+    *SQL = g_string_free(insert,FALSE);
+  }
+  return SQL_prepare(*SQL);
+}
+
+/*
+ * Step an insert statement, adding the new tracks to the shuffle bag
+ */
+static void libraryRunInsert (sqlite3_stmt *statement)
+{
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    shuffleAdd(shuffleTracks,sqlite3_column_int(statement,0));
+  }
+  sqlite3_reset(statement);
+}
+
+/*
+ * Adds a number of files to the library, LIBRARY_INSERT_BATCH rows at a time
+ */
+void addFilesToLib (GPtrArray *files)
+{
+  sqlite3_stmt *statement;
+  guint file = 0;
+
+  statement = libraryInsertStatement(LIBRARY_INSERT_BATCH);
+  while(files->len - file >= LIBRARY_INSERT_BATCH)
+  {
+    bool valid = true;
+    for(int i = 0; i < LIBRARY_INSERT_BATCH; i++)
+    {
+      valid = libraryBindFile(statement,i,g_ptr_array_index(files,file++)) && valid;
+    }
+    if(!valid)
+    {
+      // Let addFileToLib sort out which of them were usable
+      file -= LIBRARY_INSERT_BATCH;
+      break;
+    }
+    libraryRunInsert(statement);
+  }
+  SQL_release(statement);
+
+  // The rest go in one at a time
+  while(file < files->len)
+  {
+    addFileToLib(g_ptr_array_index(files,file++));
+  }
+}
+
+/*
+ * Adds a file to the library. Files that are already in it are ignored.
+ */
+void addFileToLib (const char *file)
+{
+  sqlite3_stmt *statement = libraryInsertStatement(1);
+  if(libraryBindFile(statement,0,file))
+  {
+    libraryRunInsert(statement);
+  }
+  SQL_release(statement);
+}
+
+/*
+ * Free the SQL of the insert statements and the scan pool. Called during
+ * shutdown, once the database writer has stopped.
+ */
+void libraryFinalize (void)
+{
+  if(libraryScanPool != NULL)
+  {
+    g_thread_pool_free(libraryScanPool,FALSE,TRUE);
+    g_hash_table_destroy(queuedScans);
+    libraryScanPool = NULL;
+    queuedScans     = NULL;
+  }
+  g_free(insertOneSQL);
+  g_free(insertBatchSQL);
+  insertOneSQL   = NULL;
+  insertBatchSQL = NULL;
+}
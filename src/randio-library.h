@@ -0,0 +1,29 @@
+/*
+ * How far a scan has got, passed to the progress callback of libraryScan
+ */
+struct libraryScanProgress
+{
+  /* Directories visited so far */
+  int dirsScanned;
+  /* An estimate of the number of directories left to visit */
+  int dirsLeft;
+  /* Music files found in the directories that were read */
+  int filesFound;
+};
+
+void libraryScan (const char *root, void (*progress) (const struct libraryScanProgress *status, gpointer user_data), gpointer user_data);
+bool libraryQueueScan (const char *root, void (*progress) (const struct libraryScanProgress *status, gpointer user_data), void (*done) (gpointer user_data), gpointer user_data);
+void libraryRescanAll (void);
+void libraryRescanInBackground (void);
+void libraryRemoveRoot (const char *root);
+void libraryResumePurges (void);
+bool libraryThreadNew (const char *name, GThreadFunc func, gpointer data);
+void libraryShutdown (void);
+bool libraryPathAvailable (const char *path);
+void libraryRetryDetachedRoots (void);
+void addFilesToLib (GPtrArray *files);
+void addFileToLib (const char *file);
+void libraryFinalize (void);
+char *libraryPath (int dirID, const char *name);
+char *libraryTrackPath (int trackID);
+GPtrArray *libraryDirectories (void);
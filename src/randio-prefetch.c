@@ -0,0 +1,306 @@
+/*
+ * Randio music player
+ * Read-ahead of upcoming tracks
+ * Copyright (C) Eskild Hustvedt 2011, 2012, 2017
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include <sqlite3.h>
+
+#include "randio-datatypes.h"
+#include "randio-sql.h"
+#include "randio-prefetch.h"
+
+/*
+ * Once the next track has been picked we read the start of it, so that it is
+ * in the page cache by the time playbin opens it. On slow storage (ie. nfs)
+ * that is where most of the time between tracks goes.
+ *
+ * How much is read is limited per library root by library.prefetch_mb, with
+ * the prefetchMB setting (or PREFETCH_DEFAULT_MB) used for roots that
+ * don't set it. 0 disables read-ahead.
+ *
+ * Roots with library.in_memory set (meant for disks that spin down and
+ * unreliable network mounts) have each upcoming track read into memory in
+ * its entirety instead, and playback is fed from there so that it never has
+ * to wait for the disk. The memory used by those tracks is limited by the
+ * memoryBufferMB setting (or PREFETCH_DEFAULT_MEMORY_MB), tracks that don't
+ * fit are read ahead as usual.
+ */
+
+#define PREFETCH_DEFAULT_MB 8
+#define PREFETCH_DEFAULT_MEMORY_MB 256
+#define PREFETCH_CHUNK (128*1024)
+
+/* A track held in memory, see prefetchTrack */
+struct prefetchMemory
+{
+  gpointer data;
+  gsize size;
+};
+
+/* The last track we read ahead, protected by prefetchLock */
+static char *warmedPath = NULL;
+static GMutex prefetchLock;
+
+/* Statistics. A hit is a track that started playing after we had read it
+ * ahead, a miss is one that didn't */
+static gint prefetchHits = 0;
+static gint prefetchMisses = 0;
+static gint64 prefetchBytes = 0;
+/* The number of bytes currently held in memory, protected by prefetchLock */
+static gint64 memoryHeld = 0;
+/* Set by prefetchCancel(), makes any read that is running give up */
+static gint prefetchCancelled = 0;
+
+/*
+ * Returns an integer setting, in bytes, given in MiB
+ */
+static gint64 prefetchSettingMB (const char *name, gint64 fallback)
+{
+  unsigned char *setting = SQL_getSetting(name);
+  gint64 value = fallback;
+  if(setting != NULL)
+  {
+    value = atoi((const char*) setting);
+    free(setting);
+  }
+  return value*1024*1024;
+}
+
+/*
+ * Look up the read-ahead budget, in bytes, for a file, and whether the root
+ * it lives in is kept in memory
+ */
+static void prefetchRootConfig (const char *path, gint64 *budget, bool *inMemory)
+{
+  sqlite3_stmt *statement;
+  size_t matched = 0;
+
+  *budget   = prefetchSettingMB("prefetchMB",PREFETCH_DEFAULT_MB);
+  *inMemory = false;
+
+  // The most specific root wins
+  statement = SQL_prepareRead("SELECT path, prefetch_mb, in_memory FROM library");
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    const char *root = (const char*) sqlite3_column_text(statement,0);
+    size_t len = strlen(root);
+    if(len > matched && strncmp(path,root,len) == 0 && path[len] == '/')
+    {
+      matched   = len;
+      *inMemory = sqlite3_column_int(statement,2) != 0;
+      if(sqlite3_column_type(statement,1) != SQLITE_NULL)
+      {
+        *budget = sqlite3_column_int64(statement,1)*1024*1024;
+      }
+    }
+  }
+  SQL_release(statement);
+}
+
+/*
+ * Record that path has been read ahead
+ */
+static void prefetchWarmed (const char *path, gint64 bytes)
+{
+  g_mutex_lock(&prefetchLock);
+  free(warmedPath);
+  warmedPath = strdup(path);
+  prefetchBytes += bytes;
+  g_mutex_unlock(&prefetchLock);
+}
+
+/*
+ * Frees a track held in memory, called once the last reference to its
+ * GBytes is gone
+ */
+static void prefetchFreeMemory (struct prefetchMemory *memory)
+{
+  g_mutex_lock(&prefetchLock);
+  memoryHeld -= memory->size;
+  g_mutex_unlock(&prefetchLock);
+  g_free(memory->data);
+  free(memory);
+}
+
+/*
+ * Read all of the already opened file fd into memory, if it fits within the
+ * memory budget. Returns NULL otherwise.
+ */
+static GBytes *prefetchIntoMemory (int fd)
+{
+  struct prefetchMemory *memory;
+  struct stat info;
+  gint64 budget = prefetchSettingMB("memoryBufferMB",PREFETCH_DEFAULT_MEMORY_MB);
+  gsize done = 0;
+  ssize_t got;
+  bool fits;
+
+  if(fstat(fd,&info) != 0 || info.st_size == 0)
+  {
+    return NULL;
+  }
+
+  // Reserve the memory up front, so that two loads can't both squeeze in
+  g_mutex_lock(&prefetchLock);
+  fits = memoryHeld + info.st_size <= budget;
+  if(fits)
+  {
+    memoryHeld += info.st_size;
+  }
+  g_mutex_unlock(&prefetchLock);
+  if(!fits)
+  {
+    return NULL;
+  }
+
+  memory       = malloc(sizeof(struct prefetchMemory));
+  memory->size = info.st_size;
+  memory->data = g_malloc(memory->size);
+  posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+  while(done < memory->size && !g_atomic_int_get(&prefetchCancelled) && (got = read(fd,(char*) memory->data+done,MIN(PREFETCH_CHUNK,memory->size-done))) > 0)
+  {
+    done += got;
+  }
+  if(done < memory->size)
+  {
+    // Shrunk while we were reading it, an I/O error, or we're shutting down
+    prefetchFreeMemory(memory);
+    return NULL;
+  }
+  return g_bytes_new_with_free_func(memory->data,memory->size,(GDestroyNotify) prefetchFreeMemory,memory);
+}
+
+/*
+ * Get path ready to be played. Blocks until it is done, so it should be
+ * run in a thread.
+ *
+ * If it is in a root that is kept in memory, and it fits, the whole file is
+ * returned and should be played from there. Otherwise the start of it is
+ * read into the page cache and NULL is returned.
+ */
+GBytes *prefetchTrack (const char *path)
+{
+  GBytes *inMemory = NULL;
+  gint64 budget;
+  gint64 done = 0;
+  bool keepInMemory;
+  char *buffer;
+  ssize_t got;
+  int fd;
+
+  prefetchRootConfig(path,&budget,&keepInMemory);
+  if(budget <= 0 && !keepInMemory)
+  {
+    return NULL;
+  }
+  fd = open(path,O_RDONLY|O_CLOEXEC);
+  if(fd == -1)
+  {
+    return NULL;
+  }
+
+  if(keepInMemory)
+  {
+    inMemory = prefetchIntoMemory(fd);
+  }
+  if(inMemory != NULL)
+  {
+    done = g_bytes_get_size(inMemory);
+  }
+  else if(budget > 0)
+  {
+    // Let the kernel start on all of it at once, then read it ourselves to
+    // make sure it's there, as not every filesystem acts on the advice
+    posix_fadvise(fd,0,budget,POSIX_FADV_WILLNEED);
+    buffer = malloc(PREFETCH_CHUNK);
+    while(done < budget && !g_atomic_int_get(&prefetchCancelled) && (got = read(fd,buffer,MIN(PREFETCH_CHUNK,budget-done))) > 0)
+    {
+      done += got;
+    }
+    free(buffer);
+  }
+  close(fd);
+
+  prefetchWarmed(path,done);
+  return inMemory;
+}
+
+/*
+ * Called when playback of path is about to start, to keep track of whether
+ * read-ahead is doing its job
+ */
+void prefetchTrackStarting (const char *path)
+{
+  bool hit;
+
+  g_mutex_lock(&prefetchLock);
+  hit = warmedPath != NULL && strcmp(warmedPath,path) == 0;
+  g_mutex_unlock(&prefetchLock);
+
+  g_atomic_int_inc(hit ? &prefetchHits : &prefetchMisses);
+}
+
+/*
+ * Fetch the read-ahead statistics
+ */
+void prefetchGetStats (int *hits, int *misses, gint64 *bytes)
+{
+  *hits   = g_atomic_int_get(&prefetchHits);
+  *misses = g_atomic_int_get(&prefetchMisses);
+  g_mutex_lock(&prefetchLock);
+  *bytes  = prefetchBytes;
+  g_mutex_unlock(&prefetchLock);
+}
+
+/*
+ * Make any read-ahead that is running stop soon, and any later one do
+ * nothing. Called during shutdown.
+ */
+void prefetchCancel (void)
+{
+  g_atomic_int_set(&prefetchCancelled,1);
+}
+
+/*
+ * Print the statistics and free what we're holding on to. Called during
+ * shutdown.
+ */
+void prefetchShutdown (void)
+{
+  int hits;
+  int misses;
+  gint64 bytes;
+
+  prefetchGetStats(&hits,&misses,&bytes);
+  if(hits+misses > 0)
+  {
+    printf("Read ahead %" G_GINT64_FORMAT " MiB, %d of %d tracks started from a warm cache\n",bytes/(1024*1024),hits,hits+misses);
+  }
+  g_mutex_lock(&prefetchLock);
+  free(warmedPath);
+  warmedPath = NULL;
+  g_mutex_unlock(&prefetchLock);
+}
@@ -0,0 +1,5 @@
+GBytes *prefetchTrack (const char *path);
+void prefetchTrackStarting (const char *path);
+void prefetchGetStats (int *hits, int *misses, gint64 *bytes);
+void prefetchCancel (void);
+void prefetchShutdown (void);
@@ -16,11 +16,19 @@
 #include "randio-sql.h"
 #include "randio-lastfm.h"
 #include "randio-prefs.h"
+#include "randio-scanner.h"
+#include "randio-library.h"
+#include "randio-watcher.h"
+#include "randio-dbwriter.h"
+
+/* How often, in ms, the progress of scans is shown, about 30 times a second */
+#define SCAN_PROGRESS_INTERVAL 33
 
 enum {
   DIR_PATH,
   DIR_SPINNER_ACTIVE,
   DIR_SPINNER_PULSE,
+  DIR_PROGRESS,
   DIR_DATA_ENTRIES
 };
 
@@ -58,12 +66,15 @@ void initializePrefs(struct randioGlobalStateStruct *randioGlobalState, GtkWindo
   GtkWidget *lastfmConnectButton;
   GtkWidget *rmDirectory;
   GtkWidget *addDirectory;
+  GtkWidget *rescanDirectories;
+  GtkWidget *watchLibrary;
   GtkTreeViewColumn *spinnerColumn;
   GtkCellRenderer *scanStateRenderer;
   unsigned char *user;
+  unsigned char *watching;
   sqlite3_stmt *statement;
   // First initialize the model
-  store = gtk_list_store_new(DIR_DATA_ENTRIES,G_TYPE_STRING,G_TYPE_BOOLEAN,G_TYPE_INT);
+  store = gtk_list_store_new(DIR_DATA_ENTRIES,G_TYPE_STRING,G_TYPE_BOOLEAN,G_TYPE_INT,G_TYPE_STRING);
   gtk_tree_view_set_model(treeView,GTK_TREE_MODEL(store));
 
   // Fetch the column and renderer for the spinner
@@ -77,7 +88,7 @@ void initializePrefs(struct randioGlobalStateStruct *randioGlobalState, GtkWindo
   gtk_tree_view_column_add_attribute(spinnerColumn, scanStateRenderer, "active", DIR_SPINNER_ACTIVE);
 
   // Add our current directories to the list
-  sqlite3_prepare_v2(db, "SELECT * FROM library", -1, &statement, NULL);
+  statement = SQL_prepareRead("SELECT path FROM library");
   while(sqlite3_step(statement) == SQLITE_ROW)
   {
     GtkTreeIter iter;
@@ -85,20 +96,22 @@ void initializePrefs(struct randioGlobalStateStruct *randioGlobalState, GtkWindo
     gtk_list_store_append(store, &iter);
     gtk_list_store_set(store, &iter,DIR_PATH,value,-1);
   }
-  sqlite3_finalize(statement);
+  SQL_release(statement);
   gtk_tree_view_columns_autosize(treeView);
 
 
   /*
-   * Fetch the add/remove/lastfm buttons and connect the signals.
+   * Fetch the add/remove/rescan/lastfm buttons and connect the signals.
    * The signals could in theory be connected by GtkBuilder, but we need
    * to provide some data to the callbacks
    */
   rmDirectory = GTK_WIDGET(gtk_builder_get_object(randioGlobalState->uiBuilder,"removeButton"));
   addDirectory = GTK_WIDGET(gtk_builder_get_object(randioGlobalState->uiBuilder,"addButton"));
+  rescanDirectories = GTK_WIDGET(gtk_builder_get_object(randioGlobalState->uiBuilder,"rescanButton"));
   lastfmConnectButton = GTK_WIDGET(gtk_builder_get_object(randioGlobalState->uiBuilder,"lastfmConnector"));
   g_signal_connect (rmDirectory, "clicked", G_CALLBACK(removeDirectoryFromLib), randioGlobalState);
   g_signal_connect (addDirectory, "clicked", G_CALLBACK(selectDirectoryForLib), randioGlobalState);
+  g_signal_connect (rescanDirectories, "clicked", G_CALLBACK(rescanLibrary), randioGlobalState);
   g_signal_connect (lastfmConnectButton, "clicked", G_CALLBACK(lastfmConnect), prefsWin);
 
   // If we had existing directories, make the remove button active
@@ -107,6 +120,17 @@ void initializePrefs(struct randioGlobalStateStruct *randioGlobalState, GtkWindo
     gtk_widget_set_sensitive(rmDirectory,TRUE);
   }
 
+  // Set the state of the watcher toggle before connecting the signal, so
+  // that it doesn't fire
+  watchLibrary = GTK_WIDGET(gtk_builder_get_object(randioGlobalState->uiBuilder,"watchLibrary"));
+  watching = SQL_getSetting("watchLibrary");
+  if(watching != NULL)
+  {
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(watchLibrary), strcmp((char*) watching,"1") == 0);
+    free(watching);
+  }
+  g_signal_connect (watchLibrary, "toggled", G_CALLBACK(watchLibraryToggled), NULL);
+
   lastfmInfo = GTK_WIDGET(gtk_builder_get_object(randioGlobalState->uiBuilder,"lastfmConnectionStatus"));
   user = SQL_getSetting("lastfmUser");
 
@@ -133,106 +157,169 @@ void initializePrefs(struct randioGlobalStateStruct *randioGlobalState, GtkWindo
  * **************************
  */
 
-bool scanDir (char *dir, int depth, struct randioScanProgress *progress)
+/*
+ * Scan dir, showing its progress in the row iter points to. Returns false
+ * if it is already being scanned.
+ */
+bool startScan (char *dir, GtkTreeIter iter, GtkListStore *store)
 {
-  DIR *currd  = opendir(dir);
-  bool retVal = true;
-  struct dirent *dirent;
-  char *path;
-
-  depth++;
-
-  if(depth > 100)
+  // Has to be manually allocated since we need to pass the pointer to the worker thread
+  struct randioScanProgress *progress = malloc(sizeof(struct randioScanProgress));
+  GtkTreePath *path = gtk_tree_model_get_path(GTK_TREE_MODEL(store),&iter);
+  // Needs to be duplicated since dir is on the stack
+  progress->dir = strdup(dir);
+  // A reference rather than iter, so that we notice if the row is removed
+  progress->row = gtk_tree_row_reference_new(GTK_TREE_MODEL(store),path);
+  gtk_tree_path_free(path);
+  progress->listStore = store;
+  progress->dirsScanned = 0;
+  progress->dirsLeft    = 0;
+  progress->filesFound  = 0;
+  progress->finished    = 0;
+  progress->started     = 0;
+  // Queued with the other scans, so that only a few run at a time
+  if(!libraryQueueScan(progress->dir,(void (*) (const struct libraryScanProgress*, gpointer)) scanProgress,(void (*) (gpointer)) scanFinished,progress))
   {
-    printf("Directory tree too deep, giving up at %s\n",dir);
+    gtk_tree_row_reference_free(progress->row);
+    free(progress->dir);
+    free(progress);
     return false;
   }
+  // The scan thread only counts, the list store is updated from here
+  g_timeout_add(SCAN_PROGRESS_INTERVAL, (GSourceFunc) updateScanProgress, progress);
+  return true;
+}
 
-  while( (dirent = readdir(currd)) )
-  {
-    if(strcmp(dirent->d_name,".") == 0 || strcmp(dirent->d_name,"..") == 0 || strcmp(dirent->d_name,".git") == 0)
-      continue;
+/*
+ * Called by libraryQueueScan (in the scan thread) once the scan is done,
+ * updateScanProgress then clears the row and frees progress
+ */
+void scanFinished (struct randioScanProgress *progress)
+{
+  g_atomic_int_set(&progress->finished,1);
+}
 
-    progress->currPulse++;
-    gtk_list_store_set(progress->listStore, &progress->currEntryIter,DIR_SPINNER_PULSE,progress->currPulse/100,-1);
+/*
+ * Called by libraryScan (in the scan thread) for every directory it has
+ * visited. Only stores the numbers, updateScanProgress shows them.
+ */
+void scanProgress (const struct libraryScanProgress *status, struct randioScanProgress *progress)
+{
+  g_atomic_int_set(&progress->dirsScanned,status->dirsScanned);
+  g_atomic_int_set(&progress->dirsLeft,status->dirsLeft);
+  g_atomic_int_set(&progress->filesFound,status->filesFound);
+}
 
-    path = malloc(strlen(dirent->d_name)+strlen(dir)+2);
-    sprintf(path,"%s/%s",dir,dirent->d_name);
+/*
+ * Show the progress of a directory that is being scanned. Runs on the main
+ * loop every SCAN_PROGRESS_INTERVAL ms until the scan is done.
+ */
+gboolean updateScanProgress (struct randioScanProgress *progress)
+{
+  int dirsScanned = g_atomic_int_get(&progress->dirsScanned);
+  int dirsLeft    = g_atomic_int_get(&progress->dirsLeft);
+  int filesFound  = g_atomic_int_get(&progress->filesFound);
+  GtkTreePath *path = gtk_tree_row_reference_get_path(progress->row);
+  GtkTreeIter iter;
+  double seconds;
+  char *text;
 
-    /* If we can't read it, then just skip it */
-    if (g_access(path,R_OK) != 0)
+  if(g_atomic_int_get(&progress->finished))
+  {
+    if(path != NULL)
     {
-      free(path);
-      continue;
+      gtk_tree_model_get_iter(GTK_TREE_MODEL(progress->listStore),&iter,path);
+      gtk_list_store_set(progress->listStore, &iter,DIR_SPINNER_ACTIVE,FALSE,DIR_SPINNER_PULSE,0,DIR_PROGRESS,NULL,-1);
+      gtk_tree_path_free(path);
     }
+    // progress has been manually allocated by startScan
+    gtk_tree_row_reference_free(progress->row);
+    free(progress->dir);
+    free(progress);
+    return G_SOURCE_REMOVE;
+  }
+  // The directory has been removed from the library, which stops the scan,
+  // there's nothing left to show it in
+  if(path == NULL)
+  {
+    return G_SOURCE_CONTINUE;
+  }
+  gtk_tree_model_get_iter(GTK_TREE_MODEL(progress->listStore),&iter,path);
+  gtk_tree_path_free(path);
 
-    if(g_file_test(path, G_FILE_TEST_IS_DIR))
-    {
-      if (!scanDir(path,depth,progress))
-      {
-        free(path);
-        retVal = false;
-        break;
-      }
-    }
-    else
-    {
-      // FIXME: Use gstdiscoverer instead
-      if(g_regex_match_simple("\\.(mp3|ogg|flac)$",dirent->d_name,G_REGEX_CASELESS,0))
-      {
-        addFileToLib(path);
-      }
-    }
+  // Nothing to show until the first directory has been read, which can take
+  // a while on a slow disk or share
+  if(dirsScanned == 0)
+  {
+    return G_SOURCE_CONTINUE;
+  }
+  if(progress->started == 0)
+  {
+    progress->started = g_get_monotonic_time();
+  }
 
-    free(path);
+  seconds = (g_get_monotonic_time() - progress->started) / (double) G_USEC_PER_SEC;
+  // The rates are meaningless until we've been going for a little while
+  if(seconds < 1)
+  {
+    text = g_strdup_printf("%d files, %d directories left",filesFound,dirsLeft);
   }
-  closedir(currd);
-  return retVal;
+  else
+  {
+    int eta = dirsLeft * seconds / dirsScanned;
+    text = g_strdup_printf("%d files, %.0f files/sec, %d directories left, about %d:%02d remaining",
+        filesFound,filesFound / seconds,dirsLeft,eta/60,eta%60);
+  }
+  gtk_list_store_set(progress->listStore, &iter,DIR_SPINNER_PULSE,dirsScanned/10,DIR_PROGRESS,text,-1);
+  g_free(text);
+  return G_SOURCE_CONTINUE;
 }
 
-void startScan (char *dir, GtkTreeIter iter, GtkListStore *store)
+/*
+ * Rescans every directory in the library. Only directories that have
+ * changed since the last scan are actually read.
+ */
+void rescanLibrary (GtkButton *button, struct randioGlobalStateStruct *randioGlobalState)
 {
-  // Has to be manually allocated since we need to pass the pointer to the worker thread
-  struct randioScanProgress *progress = malloc(sizeof(struct randioScanProgress));
-  // Needs to be duplicated since dir is on the stack
-  progress->dir = strdup(dir);
-  // Ditto for iter, it's on the stack in our parent
-  memcpy(&progress->currEntryIter,&iter,sizeof(GtkTreeIter));
-  progress->listStore = store;
-  progress->currPulse = 0;
-  g_thread_new("threadedScan", (GThreadFunc) runThreadedScan,progress);
-}
+  GtkTreeView *treeView;
+  GtkListStore *store;
+  GtkTreeIter iter;
+  gboolean valid;
 
-void runThreadedScan (gpointer *user_data)
-{
-  struct randioScanProgress *progress = (struct randioScanProgress *) user_data;
-  /* Use a transaction, otherwise SQLite attempts to flush the database
-   * after each INSERT, which is incredibly slow */
-  SQL_exec("BEGIN");
-  scanDir(progress->dir,0,progress);
-  SQL_exec("COMMIT");
-  gtk_list_store_set(progress->listStore, &progress->currEntryIter,DIR_SPINNER_ACTIVE,FALSE,-1);
-  gtk_list_store_set(progress->listStore, &progress->currEntryIter,DIR_SPINNER_PULSE,0,-1);
-  // progress has been manually allocated by startScan
-  free(progress);
+  g_assert( GTK_IS_BUILDER(randioGlobalState->uiBuilder));
+
+  treeView = GTK_TREE_VIEW(gtk_builder_get_object(randioGlobalState->uiBuilder,"libraryView"));
+  store = GTK_LIST_STORE(gtk_tree_view_get_model(treeView));
+
+  valid = gtk_tree_model_get_iter_first(GTK_TREE_MODEL(store),&iter);
+  while(valid)
+  {
+    gchar *path;
+    gtk_tree_model_get(GTK_TREE_MODEL(store),&iter,DIR_PATH,&path,-1);
+    // Roots that are already being scanned keep the progress they have
+    if(startScan(path,iter,store))
+    {
+      gtk_list_store_set(store, &iter,DIR_SPINNER_ACTIVE,TRUE,-1);
+    }
+    g_free(path);
+    valid = gtk_tree_model_iter_next(GTK_TREE_MODEL(store),&iter);
+  }
 }
 
 /*
- * Adds a file to the library
+ * Enables or disables the library watcher
  */
-void addFileToLib (char *file)
+void watchLibraryToggled (GtkToggleButton *button, gpointer user_data)
 {
-  sqlite3_stmt *statement;
-  sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM tracks WHERE path=?1", -1, &statement, NULL);
-  sqlite3_bind_text(statement,1,file,-1,NULL);
-  sqlite3_step(statement);
-  int value = sqlite3_column_int(statement,0);
-  sqlite3_finalize(statement);
-  if(value == 0)
+  if(gtk_toggle_button_get_active(button))
+  {
+    dbWriterSetSetting("watchLibrary","1");
+    watcherStart();
+  }
+  else
   {
-    /* TODO: Find some way to speed up sqlite. We're going to insert a huge amount
-     * of data, and don't need sqlite to flush on each insert */
-    SQL_exec_1param("INSERT INTO tracks (path) VALUES (?1)",file);
+    dbWriterSetSetting("watchLibrary","0");
+    watcherStop();
   }
 }
 
@@ -273,11 +360,13 @@ void selectDirectoryForLib (GtkButton *button, struct randioGlobalStateStruct *r
   {
     filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
     gtk_widget_destroy (dialog);
-    SQL_exec_1param("INSERT INTO library (path) VALUES (?1)",filename);
+    dbWriterExecText("INSERT INTO library (path) VALUES (?1)",filename);
     gtk_list_store_append(store, &iter);
     gtk_list_store_set(store, &iter,0,filename,-1);
-    gtk_list_store_set(store, &iter,DIR_SPINNER_ACTIVE,TRUE,-1);
-    startScan(filename,iter, store);
+    if(startScan(filename,iter, store))
+    {
+      gtk_list_store_set(store, &iter,DIR_SPINNER_ACTIVE,TRUE,-1);
+    }
     g_free(filename);
   }
   else
@@ -288,7 +377,8 @@ void selectDirectoryForLib (GtkButton *button, struct randioGlobalStateStruct *r
 
 /*
  * Removes a directory from the library.
- * Removes the entry from the list and the database */
+ * Removes the entry from the list and the database, the tracks in it are
+ * removed in the background */
 void removeDirectoryFromLib (GtkButton *button, struct randioGlobalStateStruct *randioGlobalState)
 {
   GtkTreeView *treeView;
@@ -313,7 +403,7 @@ void removeDirectoryFromLib (GtkButton *button, struct randioGlobalStateStruct *
   if (gtk_tree_model_get_iter(treeModel, &iter, selected->data))
   {
     gtk_tree_model_get_value( treeModel, &iter, 0, &value);
-    SQL_exec_1param("DELETE FROM library WHERE path=?1",g_value_get_string(&value));
+    libraryRemoveRoot(g_value_get_string(&value));
     g_value_unset(&value);
     gtk_list_store_remove(store, &iter);
   }
@@ -1,16 +1,28 @@
+struct libraryScanProgress;
+
 struct randioScanProgress
 {
   GtkListStore *listStore;
-  GtkTreeIter currEntryIter;
+  /* The row of the directory, which is gone if it was removed from the
+   * library during the scan */
+  GtkTreeRowReference *row;
   char *dir;
-  int currPulse;
+  /* Updated by the scan thread, and read atomically */
+  gint dirsScanned;
+  gint dirsLeft;
+  gint filesFound;
+  gint finished;
+  /* When the first directory was seen, only used on the main thread */
+  gint64 started;
 };
 
-bool scanDir (char *dir, int depth, struct randioScanProgress *progress);
 void showPrefs (GSimpleAction *simple,GVariant *parameter, gpointer user_data);
-void startScan (char *dir, GtkTreeIter iter, GtkListStore *store);
-void addFileToLib (char *file);
-void runThreadedScan (gpointer *user_data);
+bool startScan (char *dir, GtkTreeIter iter, GtkListStore *store);
+void scanFinished (struct randioScanProgress *progress);
+void scanProgress (const struct libraryScanProgress *status, struct randioScanProgress *progress);
+gboolean updateScanProgress (struct randioScanProgress *progress);
+void rescanLibrary (GtkButton *button, struct randioGlobalStateStruct *randioGlobalState);
+void watchLibraryToggled (GtkToggleButton *button, gpointer user_data);
 void removeDirectoryFromLib (GtkButton *button, struct randioGlobalStateStruct *randioGlobalState);
 void initializePrefs(struct randioGlobalStateStruct *randioGlobalState, GtkWindow *prefsWin, GtkTreeView *treeView);
 void selectDirectoryForLib (GtkButton *button, struct randioGlobalStateStruct *randioGlobalState);
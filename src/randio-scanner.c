@@ -0,0 +1,555 @@
+/*
+ * Randio music player
+ * Parallel library scanner
+ * Copyright (C) Eskild Hustvedt 2011, 2012, 2017
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "randio-scanner.h"
+
+/* How deep into a directory tree we are willing to go */
+#define SCAN_MAX_DEPTH 100
+
+/*
+ * The scanner walks the tree using a pool of worker threads. Each worker has
+ * its own deque of directories. A worker pushes the subdirectories it finds
+ * onto the tail of its own deque and pops from the tail again, so that it
+ * mostly walks depth-first through the part of the tree it is working on.
+ * Once a worker runs dry it steals from the head of the deques belonging to
+ * the other workers, which is where the largest unexplored subtrees are.
+ *
+ * Directories are opened relative to their parent with openat(), and
+ * dirent->d_type is trusted to tell files and directories apart, so the only
+ * syscalls per directory are the open, the reads and the close. We only stat
+ * entries when the filesystem doesn't fill in d_type (or for symlinks). Paths
+ * are built in a buffer owned by each worker, and the files found in a
+ * directory are handed to the consumer (the thread that called scannerStart)
+ * as one struct randioScanDir, with all of the paths stored in a single
+ * string chunk.
+ *
+ * If the scanner is given an index of the directories seen during the
+ * previous scan, any directory whose mtime and inode are unchanged is not
+ * read at all. Its entries can't have changed, so we just queue the
+ * subdirectories that the index knows about (which still need to be checked,
+ * since a change further down the tree doesn't touch the mtime of the
+ * parents).
+ */
+
+/*
+ * An open directory. Kept open for as long as any of its subdirectories are
+ * still queued, since they are opened relative to it.
+ */
+struct scanDirHandle
+{
+  DIR *dir;
+  char *path;
+  int depth;
+  gint refs;
+};
+
+struct scanQueuedDir
+{
+  /* NULL for the root */
+  struct scanDirHandle *parent;
+  char *name;
+};
+
+struct scanWorker
+{
+  GQueue dirs;
+  GMutex lock;
+  GThread *thread;
+  int id;
+  /* Reused for building paths */
+  GString *pathBuf;
+  struct randioScanner *scanner;
+};
+
+struct randioScanner
+{
+  struct scanWorker *workers;
+  int nWorkers;
+  /* The number of directories that have been queued but not read yet. When
+   * this drops to zero the scan is done */
+  gint pending;
+  /* Idle workers wait on this until more directories are queued */
+  GMutex idleLock;
+  GCond idleCond;
+  /* Directories that have been visited, consumed by scannerNextDir() */
+  GAsyncQueue *found;
+  GRegex *musicFile;
+  /* The directories seen during the previous scan, can be NULL */
+  GHashTable *index;
+  /* Set by scannerCancel(), queued directories are dropped without being
+   * read */
+  gint cancelled;
+  /* Statistics */
+  gint dirsScanned;
+  gint dirsUnchanged;
+  gint filesFound;
+  gint statFallbacks;
+  gint64 started;
+};
+
+/* Pushed onto the found queue once the scan is done */
+static char scanDoneMarker;
+
+/*
+ * Drop a reference to a directory handle, closing it once nobody needs it
+ */
+static void scanDirHandleUnref (struct scanDirHandle *handle)
+{
+  if(handle != NULL && g_atomic_int_dec_and_test(&handle->refs))
+  {
+    closedir(handle->dir);
+    free(handle->path);
+    free(handle);
+  }
+}
+
+/*
+ * Free a directory returned by scannerNextDir()
+ */
+void scannerFreeDir (struct randioScanDir *dir)
+{
+  if(dir->paths != NULL)
+  {
+    g_string_chunk_free(dir->paths);
+  }
+  g_ptr_array_free(dir->files,TRUE);
+  free(dir->path);
+  free(dir);
+}
+
+/*
+ * Free an entry in the index passed to scannerStart()
+ */
+void scannerFreeIndexEntry (struct randioScanIndexEntry *entry)
+{
+  g_ptr_array_free(entry->children,TRUE);
+  free(entry);
+}
+
+/*
+ * Queue a subdirectory of parent on a worker. The worker takes ownership of
+ * name.
+ */
+static void scanWorkerPush (struct scanWorker *worker, struct scanDirHandle *parent, char *name)
+{
+  struct randioScanner *scanner = worker->scanner;
+  struct scanQueuedDir *entry = malloc(sizeof(struct scanQueuedDir));
+
+  if(parent != NULL)
+  {
+    g_atomic_int_inc(&parent->refs);
+  }
+  entry->parent = parent;
+  entry->name   = name;
+
+  // Must be incremented before the entry is visible to other workers
+  g_atomic_int_inc(&scanner->pending);
+
+  g_mutex_lock(&worker->lock);
+  g_queue_push_tail(&worker->dirs,entry);
+  g_mutex_unlock(&worker->lock);
+
+  // Wake an idle worker so that it can steal it
+  g_mutex_lock(&scanner->idleLock);
+  g_cond_signal(&scanner->idleCond);
+  g_mutex_unlock(&scanner->idleLock);
+}
+
+/*
+ * Fetch the next directory for a worker. Takes from our own deque first,
+ * then tries to steal from everyone else. Returns NULL if there was nothing
+ * to be had anywhere.
+ */
+static struct scanQueuedDir *scanWorkerTake (struct scanWorker *worker)
+{
+  struct randioScanner *scanner = worker->scanner;
+  struct scanQueuedDir *entry;
+
+  g_mutex_lock(&worker->lock);
+  entry = g_queue_pop_tail(&worker->dirs);
+  g_mutex_unlock(&worker->lock);
+
+  // Start with our neighbour so that thieves spread out over the victims
+  for(int i = 1; entry == NULL && i < scanner->nWorkers; i++)
+  {
+    struct scanWorker *victim = &scanner->workers[ (worker->id+i) % scanner->nWorkers ];
+    g_mutex_lock(&victim->lock);
+    entry = g_queue_pop_head(&victim->dirs);
+    g_mutex_unlock(&victim->lock);
+  }
+  return entry;
+}
+
+/*
+ * Let the consumer know that the directory in worker->pathBuf couldn't be
+ * opened, so that it can tell a directory that is gone from one that is
+ * just unreadable right now
+ */
+static void scanWorkerFailed (struct scanWorker *worker, int error)
+{
+  struct randioScanDir *result = malloc(sizeof(struct randioScanDir));
+
+  result->path   = strdup(worker->pathBuf->str);
+  result->files  = g_ptr_array_new();
+  result->paths  = NULL;
+  result->mtime  = 0;
+  result->inode  = 0;
+  result->listed = false;
+  result->error  = error;
+  g_async_queue_push(worker->scanner->found,result);
+}
+
+/*
+ * Open a queued directory. Returns NULL if it can't be read, after
+ * reporting why.
+ */
+static struct scanDirHandle *scanWorkerOpenDir (struct scanWorker *worker, struct scanQueuedDir *entry)
+{
+  struct scanDirHandle *handle;
+  DIR *dir;
+  int fd;
+  int depth = 0;
+
+  g_string_truncate(worker->pathBuf,0);
+  if(entry->parent != NULL)
+  {
+    depth = entry->parent->depth+1;
+    g_string_append(worker->pathBuf,entry->parent->path);
+    g_string_append_c(worker->pathBuf,'/');
+  }
+  g_string_append(worker->pathBuf,entry->name);
+
+  if(depth > SCAN_MAX_DEPTH)
+  {
+    printf("Directory tree too deep, giving up at %s\n",worker->pathBuf->str);
+    scanWorkerFailed(worker,ELOOP);
+    return NULL;
+  }
+
+  fd = openat(entry->parent ? dirfd(entry->parent->dir) : AT_FDCWD, entry->name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if(fd == -1)
+  {
+    scanWorkerFailed(worker,errno);
+    return NULL;
+  }
+  dir = fdopendir(fd);
+  if(dir == NULL)
+  {
+    int error = errno;
+    close(fd);
+    scanWorkerFailed(worker,error);
+    return NULL;
+  }
+
+  handle        = malloc(sizeof(struct scanDirHandle));
+  handle->dir   = dir;
+  handle->path  = strdup(worker->pathBuf->str);
+  handle->depth = depth;
+  // This reference belongs to the worker reading the directory
+  handle->refs  = 1;
+  return handle;
+}
+
+/*
+ * Read a single directory, queueing any subdirectories and handing any music
+ * files over to the consumer
+ */
+static void scanWorkerReadDir (struct scanWorker *worker, struct scanDirHandle *handle)
+{
+  struct randioScanner *scanner = worker->scanner;
+  struct randioScanIndexEntry *known = NULL;
+  struct randioScanDir *result;
+  struct dirent *dirent;
+  struct stat info;
+  size_t dirLen;
+
+  result        = malloc(sizeof(struct randioScanDir));
+  result->path  = strdup(handle->path);
+  result->files = g_ptr_array_new();
+  result->paths = NULL;
+  result->error = 0;
+
+  // Stat the directory before reading it, so that any change made while we
+  // are reading it is picked up by the next scan
+  if(fstat(dirfd(handle->dir),&info) == 0)
+  {
+    result->mtime = info.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + info.st_mtim.tv_nsec;
+    result->inode = info.st_ino;
+  }
+  else
+  {
+    result->mtime = 0;
+    result->inode = 0;
+  }
+
+  if(scanner->index != NULL)
+  {
+    known = g_hash_table_lookup(scanner->index,handle->path);
+  }
+
+  if(known != NULL && result->mtime != 0 && known->mtime == result->mtime && known->inode == result->inode)
+  {
+    g_atomic_int_inc(&scanner->dirsUnchanged);
+    result->listed = false;
+    for(guint i = 0; i < known->children->len; i++)
+    {
+      scanWorkerPush(worker,handle,strdup(g_ptr_array_index(known->children,i)));
+    }
+    // The consumer takes ownership of the result
+    g_async_queue_push(scanner->found,result);
+    return;
+  }
+
+  g_atomic_int_inc(&scanner->dirsScanned);
+  result->listed = true;
+
+  g_string_assign(worker->pathBuf,handle->path);
+  g_string_append_c(worker->pathBuf,'/');
+  dirLen = worker->pathBuf->len;
+
+  while( (dirent = readdir(handle->dir)) )
+  {
+    unsigned char type = dirent->d_type;
+
+    if(strcmp(dirent->d_name,".") == 0 || strcmp(dirent->d_name,"..") == 0 || strcmp(dirent->d_name,".git") == 0)
+      continue;
+
+    /*
+     * Not all filesystems fill in d_type, and symlinks have to be followed
+     * to find out what they point to. Those are the only entries we stat.
+     */
+    if(type == DT_UNKNOWN || type == DT_LNK)
+    {
+      g_atomic_int_inc(&scanner->statFallbacks);
+      if(fstatat(dirfd(handle->dir),dirent->d_name,&info,0) != 0)
+      {
+        // It may be a directory that we can't get at right now, queue it
+        // so that opening it tells the consumer what went wrong
+        if(errno != ENOENT && errno != ENOTDIR)
+        {
+          scanWorkerPush(worker,handle,strdup(dirent->d_name));
+        }
+        continue;
+      }
+      if(S_ISDIR(info.st_mode))
+        type = DT_DIR;
+      else if(S_ISREG(info.st_mode))
+        type = DT_REG;
+    }
+
+    if(type == DT_DIR)
+    {
+      scanWorkerPush(worker,handle,strdup(dirent->d_name));
+    }
+    // FIXME: Use gstdiscoverer instead
+    else if(type == DT_REG && g_regex_match(scanner->musicFile,dirent->d_name,0,NULL))
+    {
+      if(result->paths == NULL)
+      {
+        result->paths = g_string_chunk_new(4096);
+      }
+      g_string_truncate(worker->pathBuf,dirLen);
+      g_string_append(worker->pathBuf,dirent->d_name);
+      g_ptr_array_add(result->files,g_string_chunk_insert_len(result->paths,worker->pathBuf->str,worker->pathBuf->len));
+    }
+  }
+
+  g_atomic_int_add(&scanner->filesFound,result->files->len);
+  // The consumer takes ownership of the result
+  g_async_queue_push(scanner->found,result);
+}
+
+/*
+ * The main loop of a worker thread
+ */
+static gpointer scanWorkerRun (struct scanWorker *worker)
+{
+  struct randioScanner *scanner = worker->scanner;
+  struct scanQueuedDir *entry;
+  struct scanDirHandle *handle;
+
+  while(true)
+  {
+    entry = scanWorkerTake(worker);
+    if(entry == NULL)
+    {
+      g_mutex_lock(&scanner->idleLock);
+      if(g_atomic_int_get(&scanner->pending) == 0)
+      {
+        g_mutex_unlock(&scanner->idleLock);
+        break;
+      }
+      // Someone is still reading a directory, wait until they queue
+      // something for us (or finish). The timeout is a safety net.
+      g_cond_wait_until(&scanner->idleCond,&scanner->idleLock,g_get_monotonic_time()+10*G_TIME_SPAN_MILLISECOND);
+      g_mutex_unlock(&scanner->idleLock);
+      continue;
+    }
+
+    handle = g_atomic_int_get(&scanner->cancelled) ? NULL : scanWorkerOpenDir(worker,entry);
+    if(handle != NULL)
+    {
+      scanWorkerReadDir(worker,handle);
+      scanDirHandleUnref(handle);
+    }
+    scanDirHandleUnref(entry->parent);
+    free(entry->name);
+    free(entry);
+
+    if(g_atomic_int_dec_and_test(&scanner->pending))
+    {
+      // That was the last directory. Every file has been queued by now, so
+      // tell the consumer that we're done and wake up the idle workers so
+      // that they can exit.
+      g_async_queue_push(scanner->found,&scanDoneMarker);
+      g_mutex_lock(&scanner->idleLock);
+      g_cond_broadcast(&scanner->idleCond);
+      g_mutex_unlock(&scanner->idleLock);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Start scanning dir. Spawns one worker thread per CPU core and returns
+ * immediately. Fetch the results with scannerNextDir() and clean up with
+ * scannerFinish().
+ *
+ * index is a hash table of paths to struct randioScanIndexEntry describing
+ * the directories seen during the last scan, or NULL to read everything. It
+ * must not be modified until scannerFinish() has been called.
+ */
+struct randioScanner *scannerStart (const char *dir, GHashTable *index)
+{
+  struct randioScanner *scanner = malloc(sizeof(struct randioScanner));
+
+  scanner->nWorkers    = g_get_num_processors();
+  scanner->workers     = calloc(scanner->nWorkers,sizeof(struct scanWorker));
+  scanner->pending     = 0;
+  scanner->found       = g_async_queue_new();
+  scanner->musicFile   = g_regex_new("\\.(mp3|ogg|flac)$",G_REGEX_CASELESS|G_REGEX_OPTIMIZE,0,NULL);
+  scanner->index       = index;
+  scanner->cancelled   = 0;
+  scanner->dirsScanned = 0;
+  scanner->dirsUnchanged = 0;
+  scanner->filesFound  = 0;
+  scanner->statFallbacks = 0;
+  scanner->started     = g_get_monotonic_time();
+  g_mutex_init(&scanner->idleLock);
+  g_cond_init(&scanner->idleCond);
+
+  for(int i = 0; i < scanner->nWorkers; i++)
+  {
+    struct scanWorker *worker = &scanner->workers[i];
+    worker->id      = i;
+    worker->scanner = scanner;
+    worker->pathBuf = g_string_sized_new(1024);
+    g_queue_init(&worker->dirs);
+    g_mutex_init(&worker->lock);
+  }
+
+  // Seed the first worker with the root, the others will steal from it
+  scanWorkerPush(&scanner->workers[0],NULL,strdup(dir));
+
+  for(int i = 0; i < scanner->nWorkers; i++)
+  {
+    scanner->workers[i].thread = g_thread_new("scanWorker", (GThreadFunc) scanWorkerRun,&scanner->workers[i]);
+  }
+  return scanner;
+}
+
+/*
+ * Retrieve the next directory that has been visited. Blocks until one is
+ * available. Free it with scannerFreeDir(). Returns NULL once the whole tree
+ * has been scanned.
+ */
+struct randioScanDir *scannerNextDir (struct randioScanner *scanner)
+{
+  gpointer next = g_async_queue_pop(scanner->found);
+  if(next == &scanDoneMarker)
+  {
+    return NULL;
+  }
+  return next;
+}
+
+/*
+ * The number of directories that have been found but not read yet
+ */
+int scannerPending (struct randioScanner *scanner)
+{
+  return g_atomic_int_get(&scanner->pending);
+}
+
+/*
+ * Stop reading directories. Whatever has already been queued is dropped, so
+ * scannerNextDir() returns NULL soon after.
+ */
+void scannerCancel (struct randioScanner *scanner)
+{
+  g_atomic_int_set(&scanner->cancelled,1);
+}
+
+/*
+ * Wait for the workers to exit, output statistics and free the scanner.
+ * Must only be called after scannerNextDir() has returned NULL.
+ */
+void scannerFinish (struct randioScanner *scanner)
+{
+  double seconds;
+
+  for(int i = 0; i < scanner->nWorkers; i++)
+  {
+    g_thread_join(scanner->workers[i].thread);
+  }
+  // Only safe once every worker is gone, since they poke at each other's locks
+  for(int i = 0; i < scanner->nWorkers; i++)
+  {
+    g_mutex_clear(&scanner->workers[i].lock);
+    g_string_free(scanner->workers[i].pathBuf,TRUE);
+  }
+
+  seconds = (g_get_monotonic_time() - scanner->started) / (double) G_USEC_PER_SEC;
+  // Avoid dividing by zero on tiny trees
+  if(seconds <= 0)
+  {
+    seconds = 0.000001;
+  }
+  printf("Scanned %d directories (skipped %d unchanged) and found %d files in %.2fs using %d threads (%.0f dirs/sec, %.0f files/sec, %d entries needed a stat)\n",
+      scanner->dirsScanned, scanner->dirsUnchanged, scanner->filesFound, seconds, scanner->nWorkers,
+      scanner->dirsScanned / seconds, scanner->filesFound / seconds, scanner->statFallbacks);
+
+  g_regex_unref(scanner->musicFile);
+  g_async_queue_unref(scanner->found);
+  g_mutex_clear(&scanner->idleLock);
+  g_cond_clear(&scanner->idleCond);
+  free(scanner->workers);
+  free(scanner);
+}
@@ -0,0 +1,40 @@
+struct randioScanner;
+
+/*
+ * A directory visited by the scanner
+ */
+struct randioScanDir
+{
+  char *path;
+  /* mtime in nanoseconds, 0 if the directory could not be stat()ed */
+  gint64 mtime;
+  guint64 inode;
+  /* false if the directory was unchanged since the last scan, in which
+   * case it wasn't read and files is empty */
+  bool listed;
+  /* 0 if the directory could be opened, otherwise the errno of the failure
+   * (ELOOP if it was too deep down the tree). listed is false. */
+  int error;
+  /* Full paths of the music files in the directory */
+  GPtrArray *files;
+  GStringChunk *paths;
+};
+
+/*
+ * A directory in the index of a previous scan
+ */
+struct randioScanIndexEntry
+{
+  gint64 mtime;
+  guint64 inode;
+  /* The names of the subdirectories (char*) */
+  GPtrArray *children;
+};
+
+struct randioScanner *scannerStart (const char *dir, GHashTable *index);
+struct randioScanDir *scannerNextDir (struct randioScanner *scanner);
+void scannerFreeDir (struct randioScanDir *dir);
+void scannerFreeIndexEntry (struct randioScanIndexEntry *entry);
+int scannerPending (struct randioScanner *scanner);
+void scannerCancel (struct randioScanner *scanner);
+void scannerFinish (struct randioScanner *scanner);
@@ -0,0 +1,760 @@
+/*
+ * Randio music player
+ * Shuffle bags
+ * Copyright (C) Eskild Hustvedt 2011, 2012, 2017
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include <sqlite3.h>
+
+#include "randio-datatypes.h"
+#include "randio-sql.h"
+#include "randio-shuffle.h"
+
+/*
+ * A shuffle bag is an array of track IDs that is shuffled lazily with
+ * Fisher-Yates. Everything before the cursor has been played during the
+ * current round, everything after it has not. Picking a track swaps a random
+ * unplayed entry to the cursor and advances it, and once the cursor reaches
+ * the end a new round starts. tracks maps track IDs back to their place in
+ * the bag, so that adding and removing tracks is O(1) as well.
+ *
+ * Tracks are not equally likely to be picked. Each slot in the bag has a
+ * weight (see shuffleTrackWeight), and a Fenwick tree over the slot weights
+ * lets us draw a slot with probability proportional to its weight, and
+ * change a single weight, in O(log n). Slots behind the cursor weigh nothing,
+ * so tracks still aren't repeated until the round is over.
+ *
+ * Which tracks have been played during the current round is also kept in a
+ * bitset indexed by track ID, in a small file that is mmap()ed. It is updated
+ * in place as tracks are played, so nothing has to be saved on exit, and on
+ * startup it is used to move the tracks that were already played behind the
+ * cursor again. Tracks that were added or removed while we weren't running
+ * don't invalidate it, a new track simply has its bit cleared.
+ */
+/* What we know about each track, indexed by track ID */
+struct shuffleTrack
+{
+  /* The index of the track in bag, or SHUFFLE_NOT_IN_BAG */
+  guint slot;
+  guint8 loved;
+  guint8 skips;
+};
+
+struct randioShuffle
+{
+  GMutex lock;
+  GRand *rand;
+  /* The track IDs (int) */
+  GArray *bag;
+  /* struct shuffleTrack, indexed by track ID */
+  GArray *tracks;
+  /* The weight of each slot in bag (guint32), 0 for played slots */
+  GArray *weights;
+  /* Fenwick tree over weights (guint64). 1-indexed, so it has one more
+   * element than bag */
+  GArray *tree;
+  /* bag[0..next) have been played during this round */
+  guint next;
+  /* Only pick loved tracks */
+  bool lovedOnly;
+  /* The mmap()ed state file, see shuffleAttachState. NULL if there is none */
+  struct shuffleStateFile *state;
+  int stateFd;
+  /* The size of the mapping, in bytes */
+  gsize stateSize;
+};
+
+#define SHUFFLE_NOT_IN_BAG G_MAXUINT
+
+/* The weight of a track that hasn't been loved or skipped.. */
+#define SHUFFLE_WEIGHT 64
+/* ..loved tracks are this many times as likely.. */
+#define SHUFFLE_LOVED_FACTOR 4
+/* ..and each skip halves the weight, up to this many times */
+#define SHUFFLE_MAX_SKIP_PENALTY 3
+
+/* The on-disk layout of the state file */
+#define SHUFFLE_STATE_MAGIC "RANDIOSH"
+#define SHUFFLE_STATE_VERSION 1
+struct shuffleStateFile
+{
+  char magic[8];
+  guint32 version;
+  guint32 reserved;
+  /* One bit per track ID, set if it has been played during this round.
+   * Runs to the end of the file. */
+  guint8 played[];
+};
+
+/* Every track that can be played */
+struct randioShuffle *shuffleTracks = NULL;
+
+/*
+ * Add delta to the weight of slot in a Fenwick tree
+ */
+static void fenwickAdd (GArray *tree, guint slot, gint64 delta)
+{
+  for(guint i = slot+1; i < tree->len; i += i & -i)
+  {
+    g_array_index(tree,guint64,i) += delta;
+  }
+}
+
+/*
+ * Returns the sum of the weights of the first slots slots
+ */
+static guint64 fenwickSum (GArray *tree, guint slots)
+{
+  guint64 sum = 0;
+  for(guint i = slots; i > 0; i -= i & -i)
+  {
+    sum += g_array_index(tree,guint64,i);
+  }
+  return sum;
+}
+
+/*
+ * Add a slot with the given weight to the end of a Fenwick tree
+ */
+static void fenwickAppend (GArray *tree, guint32 weight)
+{
+  guint i = tree->len;
+  guint64 value = weight + fenwickSum(tree,i-1) - fenwickSum(tree,i - (i & -i));
+  g_array_append_val(tree,value);
+}
+
+/*
+ * Returns the first slot where the sum of the weights up to and including
+ * it is larger than target. target must be smaller than the total weight.
+ */
+static guint fenwickFind (GArray *tree, guint64 target)
+{
+  guint pos = 0;
+  guint step = 1;
+
+  while(step*2 < tree->len)
+  {
+    step *= 2;
+  }
+  for(; step > 0; step /= 2)
+  {
+    if(pos+step < tree->len && g_array_index(tree,guint64,pos+step) <= target)
+    {
+      pos += step;
+      target -= g_array_index(tree,guint64,pos);
+    }
+  }
+  return pos;
+}
+
+/*
+ * Rebuild a Fenwick tree from scratch, in O(n)
+ */
+static void fenwickBuild (GArray *tree, GArray *weights)
+{
+  g_array_set_size(tree,weights->len+1);
+  g_array_index(tree,guint64,0) = 0;
+  for(guint i = 1; i < tree->len; i++)
+  {
+    g_array_index(tree,guint64,i) = g_array_index(weights,guint32,i-1);
+  }
+  for(guint i = 1; i < tree->len; i++)
+  {
+    guint parent = i + (i & -i);
+    if(parent < tree->len)
+    {
+      g_array_index(tree,guint64,parent) += g_array_index(tree,guint64,i);
+    }
+  }
+}
+
+/*
+ * Returns the position of trackID in the bag, or SHUFFLE_NOT_IN_BAG.
+ * Must be called with the lock held.
+ */
+static guint shufflePos (struct randioShuffle *shuffle, int trackID)
+{
+  if(trackID < 0 || (guint) trackID >= shuffle->tracks->len)
+  {
+    return SHUFFLE_NOT_IN_BAG;
+  }
+  return g_array_index(shuffle->tracks,struct shuffleTrack,trackID).slot;
+}
+
+/*
+ * Returns the weight of trackID when it hasn't been played yet
+ */
+static guint32 shuffleTrackWeight (struct randioShuffle *shuffle, int trackID)
+{
+  struct shuffleTrack *track = &g_array_index(shuffle->tracks,struct shuffleTrack,trackID);
+  guint32 weight = SHUFFLE_WEIGHT;
+
+  if(track->loved)
+  {
+    weight *= SHUFFLE_LOVED_FACTOR;
+  }
+  else if(shuffle->lovedOnly)
+  {
+    return 0;
+  }
+  return weight >> MIN(track->skips,SHUFFLE_MAX_SKIP_PENALTY);
+}
+
+/*
+ * Set the weight of a slot. Must be called with the lock held.
+ */
+static void shuffleSetSlotWeight (struct randioShuffle *shuffle, guint slot, guint32 weight)
+{
+  guint32 *current = &g_array_index(shuffle->weights,guint32,slot);
+  fenwickAdd(shuffle->tree,slot,(gint64) weight - *current);
+  *current = weight;
+}
+
+/*
+ * Put trackID at index in the bag. Must be called with the lock held, and
+ * with next already pointing past index if it is to count as played.
+ */
+static void shufflePlace (struct randioShuffle *shuffle, guint index, int trackID)
+{
+  g_array_index(shuffle->bag,int,index) = trackID;
+  g_array_index(shuffle->tracks,struct shuffleTrack,trackID).slot = index;
+  shuffleSetSlotWeight(shuffle,index,index < shuffle->next ? 0 : shuffleTrackWeight(shuffle,trackID));
+}
+
+/*
+ * Resize (or create) the mapping of the state file to size bytes. Returns
+ * false, and detaches the state file, on failure. Must be called with the
+ * lock held.
+ */
+static bool shuffleMapState (struct randioShuffle *shuffle, gsize size)
+{
+  void *map;
+
+  if(shuffle->state != NULL)
+  {
+    munmap(shuffle->state,shuffle->stateSize);
+    shuffle->state = NULL;
+  }
+  if(ftruncate(shuffle->stateFd,size) != 0 ||
+      (map = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,shuffle->stateFd,0)) == MAP_FAILED)
+  {
+    printf("Failed to map the shuffle state, it will not be kept across restarts\n");
+    close(shuffle->stateFd);
+    shuffle->stateFd = -1;
+    return false;
+  }
+  shuffle->state     = map;
+  shuffle->stateSize = size;
+  return true;
+}
+
+/*
+ * Set or clear the played bit of trackID in the state file, growing it if
+ * needed. Must be called with the lock held.
+ */
+static void shuffleSetPlayed (struct randioShuffle *shuffle, int trackID, bool played)
+{
+  gsize byte = sizeof(struct shuffleStateFile) + trackID/8;
+  guint8 bit = 1 << (trackID%8);
+
+  if(shuffle->state == NULL)
+  {
+    return;
+  }
+  if(byte >= shuffle->stateSize)
+  {
+    // Nothing to clear beyond the end of the file
+    if(!played)
+    {
+      return;
+    }
+    // Grow by doubling, in whole pages
+    if(!shuffleMapState(shuffle,MAX((byte+4096) & ~(gsize)4095,shuffle->stateSize*2)))
+    {
+      return;
+    }
+  }
+  if(played)
+  {
+    shuffle->state->played[trackID/8] |= bit;
+  }
+  else
+  {
+    shuffle->state->played[trackID/8] &= ~bit;
+  }
+}
+
+/*
+ * Returns true if trackID is marked as played in the state file. Must be
+ * called with the lock held.
+ */
+static bool shuffleWasPlayed (struct randioShuffle *shuffle, int trackID)
+{
+  gsize byte = sizeof(struct shuffleStateFile) + trackID/8;
+  if(shuffle->state == NULL || byte >= shuffle->stateSize)
+  {
+    return false;
+  }
+  return (shuffle->state->played[trackID/8] & (1 << (trackID%8))) != 0;
+}
+
+/*
+ * Recalculate the weight of every unplayed slot. Must be called with the
+ * lock held.
+ */
+static void shuffleReweigh (struct randioShuffle *shuffle)
+{
+  for(guint i = 0; i < shuffle->bag->len; i++)
+  {
+    g_array_index(shuffle->weights,guint32,i) = i < shuffle->next ? 0 :
+      shuffleTrackWeight(shuffle,g_array_index(shuffle->bag,int,i));
+  }
+  fenwickBuild(shuffle->tree,shuffle->weights);
+}
+
+/*
+ * Move the track in slot to the end of the played part of the bag, and
+ * returns it. Must be called with the lock held.
+ */
+static int shuffleTake (struct randioShuffle *shuffle, guint slot)
+{
+  int trackID = g_array_index(shuffle->bag,int,slot);
+  int first   = g_array_index(shuffle->bag,int,shuffle->next);
+  guint at    = shuffle->next;
+
+  shuffle->next++;
+  shufflePlace(shuffle,slot,first);
+  shufflePlace(shuffle,at,trackID);
+  shuffleSetPlayed(shuffle,trackID,true);
+  return trackID;
+}
+
+/*
+ * Start a new round for the played tracks that can be picked under the
+ * current filter, by moving them behind the cursor. The others (ie. tracks
+ * that aren't loved in loved only mode) keep their place in the current
+ * round. Returns false if there were none. Must be called with the lock
+ * held.
+ */
+static bool shuffleNewRound (struct randioShuffle *shuffle)
+{
+  bool found = false;
+
+  // Going backwards, everything between slot and next has already been
+  // looked at and can't be picked, so it's safe to swap with
+  for(guint slot = shuffle->next; slot-- > 0; )
+  {
+    int trackID = g_array_index(shuffle->bag,int,slot);
+    if(shuffleTrackWeight(shuffle,trackID) == 0)
+    {
+      continue;
+    }
+    shuffle->next--;
+    shufflePlace(shuffle,slot,g_array_index(shuffle->bag,int,shuffle->next));
+    shufflePlace(shuffle,shuffle->next,trackID);
+    shuffleSetPlayed(shuffle,trackID,false);
+    found = true;
+  }
+  return found;
+}
+
+/*
+ * Returns a random number between 0 and max-1
+ */
+static guint64 shuffleRandom (struct randioShuffle *shuffle, guint64 max)
+{
+  guint64 value = ((guint64) g_rand_int(shuffle->rand) << 32) | g_rand_int(shuffle->rand);
+  return value % max;
+}
+
+/*
+ * Create a new, empty, shuffle bag. The same seed will give the same
+ * sequence of tracks for the same sequence of calls.
+ */
+struct randioShuffle *shuffleNew (guint32 seed)
+{
+  struct randioShuffle *shuffle = malloc(sizeof(struct randioShuffle));
+  g_mutex_init(&shuffle->lock);
+  shuffle->rand = g_rand_new_with_seed(seed);
+  shuffle->bag     = g_array_new(FALSE,FALSE,sizeof(int));
+  shuffle->tracks  = g_array_new(FALSE,FALSE,sizeof(struct shuffleTrack));
+  shuffle->weights = g_array_new(FALSE,FALSE,sizeof(guint32));
+  shuffle->tree    = g_array_new(FALSE,TRUE,sizeof(guint64));
+  g_array_set_size(shuffle->tree,1);
+  shuffle->next      = 0;
+  shuffle->lovedOnly = false;
+  shuffle->state     = NULL;
+  shuffle->stateFd   = -1;
+  shuffle->stateSize = 0;
+  return shuffle;
+}
+
+void shuffleFree (struct randioShuffle *shuffle)
+{
+  shuffleDetachState(shuffle);
+  g_mutex_clear(&shuffle->lock);
+  g_rand_free(shuffle->rand);
+  g_array_free(shuffle->bag,TRUE);
+  g_array_free(shuffle->tracks,TRUE);
+  g_array_free(shuffle->weights,TRUE);
+  g_array_free(shuffle->tree,TRUE);
+  free(shuffle);
+}
+
+/*
+ * Add a track to the bag. It has not been played during this round, and
+ * starts out as neither loved nor skipped. Does nothing if the track is
+ * already in the bag.
+ */
+void shuffleAdd (struct randioShuffle *shuffle, int trackID)
+{
+  struct shuffleTrack *track;
+  guint32 noWeight = 0;
+
+  if(trackID < 0)
+  {
+    return;
+  }
+  g_mutex_lock(&shuffle->lock);
+  if(shufflePos(shuffle,trackID) == SHUFFLE_NOT_IN_BAG)
+  {
+    if((guint) trackID >= shuffle->tracks->len)
+    {
+      guint oldLen = shuffle->tracks->len;
+      // Grow geometrically, track IDs mostly arrive in increasing order
+      g_array_set_size(shuffle->tracks,MAX((guint) trackID+1,oldLen*2));
+      for(guint i = oldLen; i < shuffle->tracks->len; i++)
+      {
+        g_array_index(shuffle->tracks,struct shuffleTrack,i).slot = SHUFFLE_NOT_IN_BAG;
+      }
+    }
+    track = &g_array_index(shuffle->tracks,struct shuffleTrack,trackID);
+    track->loved = 0;
+    track->skips = 0;
+
+    g_array_set_size(shuffle->bag,shuffle->bag->len+1);
+    g_array_append_val(shuffle->weights,noWeight);
+    fenwickAppend(shuffle->tree,0);
+    shufflePlace(shuffle,shuffle->bag->len-1,trackID);
+    // The ID may have belonged to a track that has since been deleted
+    shuffleSetPlayed(shuffle,trackID,false);
+  }
+  g_mutex_unlock(&shuffle->lock);
+}
+
+/*
+ * Remove a track from the bag, if it is in it
+ */
+void shuffleRemove (struct randioShuffle *shuffle, int trackID)
+{
+  guint index;
+  guint last;
+
+  g_mutex_lock(&shuffle->lock);
+  index = shufflePos(shuffle,trackID);
+  if(index != SHUFFLE_NOT_IN_BAG)
+  {
+    last = shuffle->bag->len-1;
+    if(index < shuffle->next)
+    {
+      // Keep the played region contiguous: fill the hole with the last
+      // played track, and the hole that leaves with the last track
+      guint lastPlayed = shuffle->next-1;
+      shufflePlace(shuffle,index,g_array_index(shuffle->bag,int,lastPlayed));
+      shuffle->next--;
+      if(lastPlayed != last)
+      {
+        shufflePlace(shuffle,lastPlayed,g_array_index(shuffle->bag,int,last));
+      }
+    }
+    else if(index != last)
+    {
+      shufflePlace(shuffle,index,g_array_index(shuffle->bag,int,last));
+    }
+    g_array_index(shuffle->tracks,struct shuffleTrack,trackID).slot = SHUFFLE_NOT_IN_BAG;
+    // Nothing in the tree covers the last slot except its own node
+    g_array_set_size(shuffle->bag,last);
+    g_array_set_size(shuffle->weights,last);
+    g_array_set_size(shuffle->tree,last+1);
+    shuffleSetPlayed(shuffle,trackID,false);
+  }
+  g_mutex_unlock(&shuffle->lock);
+}
+
+/*
+ * Update the weight of trackID after its loved or skip state has changed.
+ * Must be called with the lock held.
+ */
+static void shuffleUpdateWeight (struct randioShuffle *shuffle, int trackID)
+{
+  guint slot = shufflePos(shuffle,trackID);
+  if(slot != SHUFFLE_NOT_IN_BAG && slot >= shuffle->next)
+  {
+    shuffleSetSlotWeight(shuffle,slot,shuffleTrackWeight(shuffle,trackID));
+  }
+}
+
+/*
+ * Mark a track as loved or not loved
+ */
+void shuffleSetLoved (struct randioShuffle *shuffle, int trackID, bool loved)
+{
+  g_mutex_lock(&shuffle->lock);
+  if(shufflePos(shuffle,trackID) != SHUFFLE_NOT_IN_BAG)
+  {
+    g_array_index(shuffle->tracks,struct shuffleTrack,trackID).loved = loved;
+    shuffleUpdateWeight(shuffle,trackID);
+  }
+  g_mutex_unlock(&shuffle->lock);
+}
+
+/*
+ * Set the number of times a track has been skipped. Only the first few skips
+ * make a difference (see SHUFFLE_MAX_SKIP_PENALTY).
+ */
+void shuffleSetSkips (struct randioShuffle *shuffle, int trackID, int skips)
+{
+  g_mutex_lock(&shuffle->lock);
+  if(shufflePos(shuffle,trackID) != SHUFFLE_NOT_IN_BAG)
+  {
+    g_array_index(shuffle->tracks,struct shuffleTrack,trackID).skips = CLAMP(skips,0,G_MAXUINT8);
+    shuffleUpdateWeight(shuffle,trackID);
+  }
+  g_mutex_unlock(&shuffle->lock);
+}
+
+/*
+ * Adjust the number of times a track has been skipped by change
+ */
+void shuffleAddSkips (struct randioShuffle *shuffle, int trackID, int change)
+{
+  int skips = 0;
+  g_mutex_lock(&shuffle->lock);
+  if(shufflePos(shuffle,trackID) != SHUFFLE_NOT_IN_BAG)
+  {
+    skips = g_array_index(shuffle->tracks,struct shuffleTrack,trackID).skips + change;
+  }
+  g_mutex_unlock(&shuffle->lock);
+  shuffleSetSkips(shuffle,trackID,skips);
+}
+
+/*
+ * Only pick loved tracks (or pick any track). Loved tracks are still more
+ * likely to be picked either way.
+ */
+void shuffleSetLovedOnly (struct randioShuffle *shuffle, bool lovedOnly)
+{
+  g_mutex_lock(&shuffle->lock);
+  if(shuffle->lovedOnly != lovedOnly)
+  {
+    shuffle->lovedOnly = lovedOnly;
+    shuffleReweigh(shuffle);
+  }
+  g_mutex_unlock(&shuffle->lock);
+}
+
+/*
+ * Returns true if trackID is in the bag
+ */
+bool shuffleContains (struct randioShuffle *shuffle, int trackID)
+{
+  bool found;
+  g_mutex_lock(&shuffle->lock);
+  found = shufflePos(shuffle,trackID) != SHUFFLE_NOT_IN_BAG;
+  g_mutex_unlock(&shuffle->lock);
+  return found;
+}
+
+/*
+ * Pick the next track to play, with a probability proportional to its
+ * weight. Every track in the bag is played once before any track is
+ * repeated. skip (usually the current track) is avoided unless it is the
+ * only track left. Returns -1 if there's nothing that can be played.
+ */
+int shuffleNext (struct randioShuffle *shuffle, int skip)
+{
+  guint64 total = 0;
+  guint pick;
+  int trackID = -1;
+
+  g_mutex_lock(&shuffle->lock);
+  if(shuffle->bag->len > 0)
+  {
+    total = fenwickSum(shuffle->tree,shuffle->bag->len);
+    // Everything that can be played has been played, start a new round.
+    // If nothing can be played there's nothing to start.
+    if(total == 0 && shuffleNewRound(shuffle))
+    {
+      total = fenwickSum(shuffle->tree,shuffle->bag->len);
+    }
+  }
+  if(shuffle->bag->len > 0 && total > 0)
+  {
+    pick = fenwickFind(shuffle->tree,shuffleRandom(shuffle,total));
+    if(g_array_index(shuffle->bag,int,pick) == skip && total > g_array_index(shuffle->weights,guint32,pick))
+    {
+      // Pick again among the others
+      guint32 weight = g_array_index(shuffle->weights,guint32,pick);
+      guint other;
+      shuffleSetSlotWeight(shuffle,pick,0);
+      other = fenwickFind(shuffle->tree,shuffleRandom(shuffle,total-weight));
+      shuffleSetSlotWeight(shuffle,pick,weight);
+      pick = other;
+    }
+    trackID = shuffleTake(shuffle,pick);
+  }
+  g_mutex_unlock(&shuffle->lock);
+  return trackID;
+}
+
+/*
+ * Keep the played state of a bag in the file at path, picking up where we
+ * left off if it already exists. Tracks that are already in the bag and that
+ * were played during the current round are moved behind the cursor.
+ */
+void shuffleAttachState (struct randioShuffle *shuffle, const char *path)
+{
+  struct stat info;
+  bool valid;
+
+  g_mutex_lock(&shuffle->lock);
+  shuffle->stateFd = open(path,O_RDWR|O_CREAT|O_CLOEXEC,0600);
+  if(shuffle->stateFd == -1 || fstat(shuffle->stateFd,&info) != 0)
+  {
+    printf("Failed to open %s, the shuffle state will not be kept across restarts\n",path);
+    if(shuffle->stateFd != -1)
+    {
+      close(shuffle->stateFd);
+      shuffle->stateFd = -1;
+    }
+    g_mutex_unlock(&shuffle->lock);
+    return;
+  }
+
+  if(!shuffleMapState(shuffle,MAX(info.st_size,4096)))
+  {
+    g_mutex_unlock(&shuffle->lock);
+    return;
+  }
+
+  valid = info.st_size >= (off_t) sizeof(struct shuffleStateFile) &&
+    memcmp(shuffle->state->magic,SHUFFLE_STATE_MAGIC,sizeof(shuffle->state->magic)) == 0 &&
+    shuffle->state->version == SHUFFLE_STATE_VERSION;
+  if(!valid)
+  {
+    // New, or something we don't understand. Start a new round.
+    memset(shuffle->state,0,shuffle->stateSize);
+    memcpy(shuffle->state->magic,SHUFFLE_STATE_MAGIC,sizeof(shuffle->state->magic));
+    shuffle->state->version = SHUFFLE_STATE_VERSION;
+  }
+  else
+  {
+    for(guint i = shuffle->next; i < shuffle->bag->len; i++)
+    {
+      if(shuffleWasPlayed(shuffle,g_array_index(shuffle->bag,int,i)))
+      {
+        shuffleTake(shuffle,i);
+      }
+    }
+  }
+  g_mutex_unlock(&shuffle->lock);
+}
+
+/*
+ * Stop keeping the played state of a bag on disk
+ */
+void shuffleDetachState (struct randioShuffle *shuffle)
+{
+  g_mutex_lock(&shuffle->lock);
+  if(shuffle->state != NULL)
+  {
+    munmap(shuffle->state,shuffle->stateSize);
+    shuffle->state = NULL;
+  }
+  if(shuffle->stateFd != -1)
+  {
+    close(shuffle->stateFd);
+    shuffle->stateFd = -1;
+  }
+  g_mutex_unlock(&shuffle->lock);
+}
+
+/*
+ * Build the bag from the database and restore its state from the previous
+ * run. Called during startup, after SQLite_init and before anything can
+ * write to the library.
+ */
+void shuffleInit (char *confDir)
+{
+  sqlite3_stmt *statement;
+  char *path;
+
+  shuffleTracks = shuffleNew(g_random_int());
+  statement = SQL_prepareRead("SELECT tracks.track_id, loved.track_id IS NOT NULL, skips FROM tracks LEFT JOIN loved ON loved.track_id=tracks.track_id WHERE banned != 1 AND missing != 1 AND tracks.track_id NOT IN (SELECT track_id FROM failures WHERE retry_after > strftime('%s','now'))");
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    shuffleRestore(sqlite3_column_int(statement,0),sqlite3_column_int(statement,1),sqlite3_column_int(statement,2));
+  }
+  SQL_release(statement);
+
+  path = g_build_filename(confDir,"shuffle-tracks.state",NULL);
+  shuffleAttachState(shuffleTracks,path);
+  g_free(path);
+  free(confDir);
+}
+
+/*
+ * Release the bag. Called during shutdown, once nothing can pick or write
+ * tracks any more.
+ */
+void shuffleShutdown (void)
+{
+  if(shuffleTracks == NULL)
+  {
+    return;
+  }
+  shuffleFree(shuffleTracks);
+  shuffleTracks = NULL;
+}
+
+/*
+ * Put a track that is already in the library into the bag, ie. one that
+ * has come back after having gone missing
+ */
+void shuffleRestore (int trackID, bool loved, int skips)
+{
+  shuffleAdd(shuffleTracks,trackID);
+  shuffleSetSkips(shuffleTracks,trackID,skips);
+  shuffleSetLoved(shuffleTracks,trackID,loved);
+}
+
+/*
+ * A track has been removed from the library (or banned, or gone missing)
+ */
+void shuffleForgetTrack (int trackID)
+{
+  shuffleRemove(shuffleTracks,trackID);
+}
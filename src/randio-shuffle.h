@@ -0,0 +1,20 @@
+struct randioShuffle;
+
+extern struct randioShuffle *shuffleTracks;
+
+struct randioShuffle *shuffleNew (guint32 seed);
+void shuffleFree (struct randioShuffle *shuffle);
+void shuffleAdd (struct randioShuffle *shuffle, int trackID);
+void shuffleRemove (struct randioShuffle *shuffle, int trackID);
+void shuffleSetLoved (struct randioShuffle *shuffle, int trackID, bool loved);
+void shuffleSetSkips (struct randioShuffle *shuffle, int trackID, int skips);
+void shuffleAddSkips (struct randioShuffle *shuffle, int trackID, int change);
+void shuffleSetLovedOnly (struct randioShuffle *shuffle, bool lovedOnly);
+bool shuffleContains (struct randioShuffle *shuffle, int trackID);
+int shuffleNext (struct randioShuffle *shuffle, int skip);
+void shuffleAttachState (struct randioShuffle *shuffle, const char *path);
+void shuffleDetachState (struct randioShuffle *shuffle);
+void shuffleInit (char *confDir);
+void shuffleShutdown (void);
+void shuffleRestore (int trackID, bool loved, int skips);
+void shuffleForgetTrack (int trackID);
@@ -28,9 +28,48 @@
 #include "randio-datatypes.h"
 #include "randio-sql.h"
 
-/* The database pointer */
+/* How long, in ms, to wait for a lock before giving up */
+#define SQL_BUSY_TIMEOUT 5000
+
+/* The database pointer. This is the connection that writes go through,
+ * most of them on the database writer thread. */
 sqlite3 *db;
 
+/*
+ * Prepared statements, kept around for reuse. Keyed by their SQL text (as
+ * returned by sqlite3_sql(), so it lives as long as the statement does).
+ * A statement is taken out of the cache while it is being used, so that
+ * two threads never share one, and put back by SQL_release().
+ */
+struct SQL_statementCache
+{
+  GHashTable *statements;
+  GMutex lock;
+};
+
+/* The cache for db */
+static struct SQL_statementCache writeCache;
+
+/*
+ * A read-only connection, each thread that reads through SQL_prepareRead
+ * gets its own. The database is in WAL mode, so they never wait for the
+ * writer, they just don't see what it hasn't committed yet.
+ */
+struct SQL_reader
+{
+  sqlite3 *db;
+  struct SQL_statementCache cache;
+};
+
+static void SQL_closeReader (struct SQL_reader *reader);
+static GPrivate readerConnection = G_PRIVATE_INIT((GDestroyNotify) SQL_closeReader);
+/* Where the database lives, for opening the readers */
+static char *dbPath = NULL;
+
+/* The number of statements SQL_exec has seen fail, used to tell if a
+ * migration worked */
+static int SQL_errors = 0;
+
 /*
  * Short form for a quick sqlite3_exec
  */
@@ -42,135 +81,574 @@ void SQL_exec (const char *SQL)
   {
     printf("Error from sqlite when executing statement '%s': %s\n",SQL,error);
     sqlite3_free(error);
+    SQL_errors++;
   }
 }
 
 /*
- * Initialize SQLite, creating the database if needed. Called during startup
+ * Fetch SQL from cache, or prepare it on connection if it isn't there
  */
-void SQLite_init (char *confDir)
+static sqlite3_stmt *SQL_cacheTake (struct SQL_statementCache *cache, sqlite3 *connection, const char *SQL)
 {
-  const char *FNAM = "randio.sqlite";
-  char *fpath;
-  bool existed;
+  sqlite3_stmt *statement = NULL;
+  gpointer key;
 
-  fpath = malloc(strlen(confDir)+strlen(FNAM)+2);
-  sprintf(fpath,"%s/%s",confDir,FNAM);
-  existed = g_file_test(fpath,G_FILE_TEST_EXISTS);
-  // FIXME: Check if the DB was properly opened
-  if(sqlite3_config(SQLITE_CONFIG_SERIALIZED) != SQLITE_OK)
+  g_mutex_lock(&cache->lock);
+  if(g_hash_table_steal_extended(cache->statements,SQL,&key,(gpointer*) &statement) == FALSE)
   {
-    printf("Failed to set SQLite to SERIALIZED mode (required for threadsafety), expect trouble\n");
+    statement = NULL;
   }
-  sqlite3_open(fpath, &db);
+  g_mutex_unlock(&cache->lock);
 
-  if (!existed)
+  if(statement == NULL && sqlite3_prepare_v3(connection,SQL,-1,SQLITE_PREPARE_PERSISTENT,&statement,NULL) != SQLITE_OK)
   {
-    SQL_exec("CREATE TABLE tracks (track_id INTEGER PRIMARY KEY, path TEXT, banned TINYINT(1) DEFAULT 0);");
-    SQL_exec("CREATE TABLE loved (track_id INT(11) PRIMARY KEY);");
-    SQL_exec("CREATE TABLE settings (name VARCHAR(254) PRIMARY KEY, value VARCHAR(254));");
-    SQL_exec("CREATE TABLE library (path VARCHAR(254) PRIMARY KEY);");
+    printf("Error from sqlite when preparing statement '%s': %s\n",SQL,sqlite3_errmsg(connection));
+    sqlite3_finalize(statement);
+    statement = NULL;
   }
-  SQL_exec("CREATE TEMP TABLE played (track_id INTEGER PRIMARY KEY)");
-  // TODO: Add a settings field containing version
-  free(confDir);
-  free(fpath);
+  return statement;
 }
 
 /*
- * Retrieve a setting
- *
- * Note: this function returns NULL if the setting does not exist,
- * but it also returns NULL if the setting is set to NULL. A setting
- * should never be set to NULL, but it is something to be aware of.
+ * Put statement back into cache. If another copy of it got there first
+ * (ie. two threads used it at once) this one is finalized.
  */
-unsigned char* SQL_getSetting (const char *setting)
+static void SQL_cachePut (struct SQL_statementCache *cache, sqlite3_stmt *statement)
+{
+  bool added;
+
+  sqlite3_reset(statement);
+  sqlite3_clear_bindings(statement);
+  g_mutex_lock(&cache->lock);
+  added = !g_hash_table_contains(cache->statements,sqlite3_sql(statement));
+  if(added)
+  {
+    g_hash_table_insert(cache->statements,(gpointer) sqlite3_sql(statement),statement);
+  }
+  g_mutex_unlock(&cache->lock);
+  if(!added)
+  {
+    sqlite3_finalize(statement);
+  }
+}
+
+static void SQL_cacheInit (struct SQL_statementCache *cache)
+{
+  cache->statements = g_hash_table_new_full(g_str_hash,g_str_equal,NULL,(GDestroyNotify) sqlite3_finalize);
+  g_mutex_init(&cache->lock);
+}
+
+static void SQL_cacheClear (struct SQL_statementCache *cache)
+{
+  g_hash_table_destroy(cache->statements);
+  g_mutex_clear(&cache->lock);
+}
+
+/*
+ * Returns a prepared statement for SQL on db, reusing one from earlier
+ * calls if possible. Hand it back with SQL_release() when done with it,
+ * never finalize it. Returns NULL if SQL is invalid.
+ */
+sqlite3_stmt *SQL_prepare (const char *SQL)
+{
+  return SQL_cacheTake(&writeCache,db,SQL);
+}
+
+/*
+ * As SQL_prepare(), but on the calling thread's read-only connection. Only
+ * sees what has been committed.
+ */
+sqlite3_stmt *SQL_prepareRead (const char *SQL)
+{
+  struct SQL_reader *reader = g_private_get(&readerConnection);
+
+  if(reader == NULL)
+  {
+    reader = malloc(sizeof(struct SQL_reader));
+    if(sqlite3_open_v2(dbPath,&reader->db,SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX,NULL) != SQLITE_OK)
+    {
+      printf("Failed to open a read connection to the database: %s\n",sqlite3_errmsg(reader->db));
+    }
+    sqlite3_busy_timeout(reader->db,SQL_BUSY_TIMEOUT);
+    SQL_cacheInit(&reader->cache);
+    g_private_set(&readerConnection,reader);
+  }
+  return SQL_cacheTake(&reader->cache,reader->db,SQL);
+}
+
+/*
+ * Hand back a statement from SQL_prepare() or SQL_prepareRead(). Accepts
+ * NULL.
+ */
+void SQL_release (sqlite3_stmt *statement)
+{
+  struct SQL_reader *reader;
+
+  if(statement == NULL)
+  {
+    return;
+  }
+  if(sqlite3_db_handle(statement) == db)
+  {
+    SQL_cachePut(&writeCache,statement);
+    return;
+  }
+  // Readers are per thread, so this has to be the calling thread's
+  reader = g_private_get(&readerConnection);
+  SQL_cachePut(&reader->cache,statement);
+}
+
+/*
+ * Close a read connection, called when the thread that owned it exits
+ */
+static void SQL_closeReader (struct SQL_reader *reader)
+{
+  SQL_cacheClear(&reader->cache);
+  sqlite3_close(reader->db);
+  free(reader);
+}
+
+/*
+ * Adds a column to an existing table, unless it is already there
+ */
+static void SQL_addColumn (const char *table, const char *column, const char *definition)
 {
   sqlite3_stmt *statement;
-  const unsigned char* sqliteValue;
-  unsigned char* value = NULL;
+  char *SQL;
+  bool found = false;
 
-  sqlite3_prepare_v2(db, "SELECT value FROM settings WHERE name=?1", -1, &statement, NULL);
-  sqlite3_bind_text(statement,1,setting,-1,NULL);
-  sqlite3_step(statement);
-  sqliteValue = sqlite3_column_text(statement,0);
-  if(sqliteValue != NULL)
+  SQL = g_strdup_printf("PRAGMA table_info(%s)",table);
+  sqlite3_prepare_v2(db, SQL, -1, &statement, NULL);
+  while(sqlite3_step(statement) == SQLITE_ROW)
   {
-    value = (unsigned char*) strdup((char*) sqliteValue);
+    if(strcmp((const char*) sqlite3_column_text(statement,1),column) == 0)
+    {
+      found = true;
+    }
   }
   sqlite3_finalize(statement);
-  return value;
+  g_free(SQL);
+
+  if(!found)
+  {
+    SQL = g_strdup_printf("ALTER TABLE %s ADD COLUMN %s %s",table,column,definition);
+    SQL_exec(SQL);
+    g_free(SQL);
+  }
 }
 
 /*
- * Set a setting
+ * Adds the unique index on tracks.path. Databases created before the index
+ * existed can contain the same path more than once, so those have to be
+ * merged first.
  */
-void SQL_setSetting (const char *key, const char *value)
+static void SQL_addTrackPathIndex (void)
 {
-  const char *update = "UPDATE settings SET value=?1 WHERE name=?2";
-  const char *insert = "INSERT INTO SETTINGS (value,name) VALUES (?1,?2)";
   sqlite3_stmt *statement;
+  int hasIndex;
+
+  sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND name='tracks_path'", -1, &statement, NULL);
+  sqlite3_step(statement);
+  hasIndex = sqlite3_column_int(statement,0);
+  sqlite3_finalize(statement);
+  if(hasIndex)
+  {
+    return;
+  }
+
+  // Keep the lowest track_id for each path, moving bans and loves onto it.
+  // The keys are needed, each row of tracks looks one of these up.
+  SQL_exec("CREATE TEMP TABLE keep (track_id INTEGER PRIMARY KEY, path TEXT UNIQUE, banned TINYINT(1))");
+  SQL_exec("INSERT INTO keep SELECT MIN(track_id), path, MAX(banned) FROM tracks GROUP BY path");
+  SQL_exec("UPDATE tracks SET banned=(SELECT banned FROM keep WHERE keep.track_id=tracks.track_id) WHERE track_id IN (SELECT track_id FROM keep)");
+  SQL_exec("UPDATE OR IGNORE loved SET track_id=(SELECT keep.track_id FROM keep JOIN tracks ON tracks.path=keep.path WHERE tracks.track_id=loved.track_id) WHERE track_id IN (SELECT track_id FROM tracks)");
+  SQL_exec("DELETE FROM loved WHERE track_id NOT IN (SELECT track_id FROM keep)");
+  SQL_exec("DELETE FROM tracks WHERE track_id NOT IN (SELECT track_id FROM keep)");
+  SQL_exec("DROP TABLE keep");
+  SQL_exec("CREATE UNIQUE INDEX tracks_path ON tracks (path)");
+}
+
+/*
+ * Migration 1: everything that was added before the schema was versioned.
+ * Older versions of randio created tables and columns as they went, so a
+ * database at version 0 can have any subset of these.
+ */
+static void SQL_migrateUnversioned (void)
+{
+  SQL_exec("CREATE TABLE IF NOT EXISTS tracks (track_id INTEGER PRIMARY KEY, path TEXT, banned TINYINT(1) DEFAULT 0);");
+  SQL_exec("CREATE TABLE IF NOT EXISTS loved (track_id INT(11) PRIMARY KEY);");
+  SQL_exec("CREATE TABLE IF NOT EXISTS settings (name VARCHAR(254) PRIMARY KEY, value VARCHAR(254));");
+  SQL_exec("CREATE TABLE IF NOT EXISTS library (path VARCHAR(254) PRIMARY KEY);");
+  SQL_exec("CREATE TABLE IF NOT EXISTS directories (dir_id INTEGER PRIMARY KEY, path TEXT UNIQUE, mtime INTEGER, inode INTEGER);");
+  SQL_addTrackPathIndex();
+  // Tags of tracks that have been played, see randio-tagcache.c
+  SQL_exec("CREATE TABLE IF NOT EXISTS tags (track_id INTEGER PRIMARY KEY, mtime INTEGER, artist TEXT, title TEXT, album TEXT, duration INTEGER);");
+  // Tracks that failed to play, see randio-validator.c
+  SQL_exec("CREATE TABLE IF NOT EXISTS failures (track_id INTEGER PRIMARY KEY, domain TEXT, code INTEGER, message TEXT, count INTEGER DEFAULT 0, last_failed INTEGER, retry_after INTEGER);");
+  // The number of times a track has been skipped, see randio-shuffle.c
+  SQL_addColumn("tracks","skips","INTEGER DEFAULT 0");
+  // Set for tracks that couldn't be read, see randio-validator.c
+  SQL_addColumn("tracks","missing","TINYINT(1) DEFAULT 0");
+  // How much of each track to read ahead, see randio-prefetch.c
+  SQL_addColumn("library","prefetch_mb","INTEGER");
+  SQL_addColumn("library","in_memory","TINYINT(1) DEFAULT 0");
+}
+
+/*
+ * Migration 2: indexes for the queries that run over the whole library
+ */
+static void SQL_migrateIndexes (void)
+{
+  // shuffleInit() and the validator only look at tracks that aren't banned,
+  // this covers everything shuffleInit() needs from tracks
+  SQL_exec("CREATE INDEX IF NOT EXISTS tracks_playable ON tracks (track_id, missing, skips) WHERE banned != 1");
+  // validatorApplyRetry() looks for tracks whose time is up
+  SQL_exec("CREATE INDEX IF NOT EXISTS failures_retry ON failures (retry_after) WHERE retry_after IS NOT NULL");
+}
 
-  const char *expression;
-  unsigned char *prevValue = SQL_getSetting(key);
-  if(prevValue != NULL)
+/*
+ * Runs statement to completion, returns false (and counts it as an error)
+ * if it failed
+ */
+static bool SQL_migrateStep (sqlite3_stmt *statement)
+{
+  int result = sqlite3_step(statement);
+  sqlite3_reset(statement);
+  if(result != SQLITE_DONE && result != SQLITE_ROW)
   {
-    expression = update;
-    free(prevValue);
+    printf("Error from sqlite when executing statement '%s': %s\n",sqlite3_sql(statement),sqlite3_errmsg(db));
+    SQL_errors++;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Returns the dir_id of path in the directories table of migration 3,
+ * adding it and any missing parents. ids holds the dir_ids added so far.
+ * Migrations have to keep working on the schema as it was when they were
+ * written, which is why this doesn't use randio-library.c.
+ */
+static int SQL_migrateDirID (GHashTable *ids, sqlite3_stmt *insert, const char *path)
+{
+  const char *name = strrchr(path,'/');
+  gpointer found;
+  int parentID = -1;
+  int dirID;
+
+  if(g_hash_table_lookup_extended(ids,path,NULL,&found))
+  {
+    return GPOINTER_TO_INT(found);
+  }
+  if(name == NULL)
+  {
+    return -1;
+  }
+  if(name == path && path[1] == '\0')
+  {
+    name = "";
   }
   else
   {
-    expression = insert;
+    char *parent = name == path ? strdup("/") : g_strndup(path,name-path);
+    parentID = SQL_migrateDirID(ids,insert,parent);
+    free(parent);
+    if(parentID == -1)
+    {
+      return -1;
+    }
+    name++;
   }
 
-  sqlite3_prepare_v2(db,expression,-1,&statement, NULL);
-  sqlite3_bind_text(statement,1,value,-1,NULL);
-  sqlite3_bind_text(statement,2,key,-1,NULL);
-  sqlite3_step(statement);
+  sqlite3_clear_bindings(insert);
+  if(parentID != -1)
+  {
+    sqlite3_bind_int(insert,1,parentID);
+  }
+  sqlite3_bind_text(insert,2,name,-1,NULL);
+  if(!SQL_migrateStep(insert))
+  {
+    return -1;
+  }
+  dirID = sqlite3_last_insert_rowid(db);
+  g_hash_table_insert(ids,strdup(path),GINT_TO_POINTER(dirID));
+  return dirID;
+}
+
+/*
+ * Migration 3: store directories as a tree of names, and tracks as the
+ * dir_id of their directory plus their file name, instead of repeating the
+ * full path of the directory in every row. See randio-library.c.
+ */
+static void SQL_migrateNormalizePaths (void)
+{
+  GHashTable *ids = g_hash_table_new_full(g_str_hash,g_str_equal,free,NULL);
+  sqlite3_stmt *statement;
+  sqlite3_stmt *insertDir;
+  sqlite3_stmt *insert;
+
+  SQL_exec("ALTER TABLE directories RENAME TO old_directories");
+  // AUTOINCREMENT so that dir_ids are never reused, they're cached
+  SQL_exec("CREATE TABLE directories (dir_id INTEGER PRIMARY KEY AUTOINCREMENT, parent_id INTEGER, name TEXT NOT NULL, mtime INTEGER, inode INTEGER)");
+  SQL_exec("CREATE UNIQUE INDEX directories_name ON directories (parent_id, name)");
+  SQL_exec("CREATE TABLE new_tracks (track_id INTEGER PRIMARY KEY, dir_id INTEGER NOT NULL, name TEXT NOT NULL, banned TINYINT(1) DEFAULT 0, skips INTEGER DEFAULT 0, missing TINYINT(1) DEFAULT 0)");
+
+  sqlite3_prepare_v2(db, "INSERT INTO directories (parent_id, name) VALUES (?1, ?2)", -1, &insertDir, NULL);
+
+  sqlite3_prepare_v2(db, "SELECT path, mtime, inode FROM old_directories", -1, &statement, NULL);
+  sqlite3_prepare_v2(db, "UPDATE directories SET mtime=?2, inode=?3 WHERE dir_id=?1", -1, &insert, NULL);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    int dirID = SQL_migrateDirID(ids,insertDir,(const char*) sqlite3_column_text(statement,0));
+    if(dirID != -1)
+    {
+      sqlite3_bind_int(insert,1,dirID);
+      sqlite3_bind_int64(insert,2,sqlite3_column_int64(statement,1));
+      sqlite3_bind_int64(insert,3,sqlite3_column_int64(statement,2));
+      SQL_migrateStep(insert);
+    }
+  }
+  sqlite3_finalize(statement);
+  sqlite3_finalize(insert);
+
+  sqlite3_prepare_v2(db, "SELECT track_id, path, banned, skips, missing FROM tracks", -1, &statement, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO new_tracks (track_id, dir_id, name, banned, skips, missing) VALUES (?1, ?2, ?3, ?4, ?5, ?6)", -1, &insert, NULL);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    const char *path = (const char*) sqlite3_column_text(statement,1);
+    const char *name = path != NULL ? strrchr(path,'/') : NULL;
+    char *dir;
+    int dirID;
+
+    if(name == NULL)
+    {
+      printf("Dropping track %d from the library, %s is not a valid path\n",sqlite3_column_int(statement,0),path);
+      continue;
+    }
+    dir   = name == path ? strdup("/") : g_strndup(path,name-path);
+    dirID = SQL_migrateDirID(ids,insertDir,dir);
+    free(dir);
+    if(dirID == -1)
+    {
+      printf("Dropping track %d from the library, unable to store the directory of %s\n",sqlite3_column_int(statement,0),path);
+      continue;
+    }
+    sqlite3_bind_int(insert,1,sqlite3_column_int(statement,0));
+    sqlite3_bind_int(insert,2,dirID);
+    sqlite3_bind_text(insert,3,name+1,-1,NULL);
+    sqlite3_bind_int(insert,4,sqlite3_column_int(statement,2));
+    sqlite3_bind_int(insert,5,sqlite3_column_int(statement,3));
+    sqlite3_bind_int(insert,6,sqlite3_column_int(statement,4));
+    SQL_migrateStep(insert);
+  }
   sqlite3_finalize(statement);
+  sqlite3_finalize(insert);
+  sqlite3_finalize(insertDir);
+  g_hash_table_destroy(ids);
+
+  SQL_exec("DROP TABLE tracks");
+  SQL_exec("DROP TABLE old_directories");
+  SQL_exec("ALTER TABLE new_tracks RENAME TO tracks");
+  SQL_exec("DELETE FROM loved WHERE track_id NOT IN (SELECT track_id FROM tracks)");
+  SQL_exec("DELETE FROM tags WHERE track_id NOT IN (SELECT track_id FROM tracks)");
+  SQL_exec("DELETE FROM failures WHERE track_id NOT IN (SELECT track_id FROM tracks)");
+  SQL_exec("CREATE UNIQUE INDEX tracks_name ON tracks (dir_id, name)");
+  // Dropped along with the old table, see SQL_migrateIndexes()
+  SQL_exec("CREATE INDEX tracks_playable ON tracks (track_id, missing, skips) WHERE banned != 1");
+}
+
+/*
+ * Migration 4: switch to auto_vacuum=INCREMENTAL, see SQLite_init(). An
+ * existing database only changes its auto_vacuum mode when it is vacuumed,
+ * which can't be done inside the migration's transaction, so
+ * SQL_setAutoVacuum() does that afterwards.
+ */
+static void SQL_migrateIncrementalVacuum (void)
+{
+}
+
+/*
+ * Migration 5: library roots that have been removed but still have tracks
+ * left, see libraryRemoveRoot()
+ */
+static void SQL_migratePurges (void)
+{
+  SQL_exec("CREATE TABLE purges (path TEXT PRIMARY KEY)");
 }
 
 /*
- * Get a random track to play. Returns the track_id
+ * The migrations, in order. The schema version (PRAGMA user_version) of a
+ * database is the number of these that have been applied to it. Never
+ * change or reorder one that has been released, add a new one instead.
+ */
+static void (*const SQL_migrations[]) (void) = {
+  SQL_migrateUnversioned,
+  SQL_migrateIndexes,
+  SQL_migrateNormalizePaths,
+  SQL_migrateIncrementalVacuum,
+  SQL_migratePurges,
+};
+
+/*
+ * Brings the schema of the database up to date. All pending migrations are
+ * applied in a single transaction, if one of them fails none of them are.
  */
-int SQL_getTrackRND (bool playOnlyLoved, struct trackTag currTrack)
+static void SQL_migrate (void)
 {
-  const char *from;
-  char SQL[254];
-  char WHERE[254] = "";
   sqlite3_stmt *statement;
-  int trackID;
+  int version = 0;
+  int target = sizeof(SQL_migrations)/sizeof(SQL_migrations[0]);
+  int errors = SQL_errors;
+  bool existing;
+  char *SQL;
 
-  if(playOnlyLoved)
+  sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &statement, NULL);
+  if(sqlite3_step(statement) == SQLITE_ROW)
   {
-    from = "loved";
+    version = sqlite3_column_int(statement,0);
   }
-  else
+  sqlite3_finalize(statement);
+
+  // Databases from before the schema was versioned are at version 0 too,
+  // just like new ones, but they have tables
+  sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type='table' AND name='tracks'", -1, &statement, NULL);
+  existing = sqlite3_step(statement) == SQLITE_ROW;
+  sqlite3_finalize(statement);
+
+  if(version > target)
   {
-    from = "tracks";
+    printf("The database is from a newer version of randio (schema %d, this version knows %d), expect trouble\n",version,target);
+    return;
   }
-  /*
-   * If we have a currTrack, make sure we don't change to the same one
-   */
-  if(currTrack.trackID != -1)
+  if(version == target)
   {
-    sprintf(WHERE," AND track_id != %d ",currTrack.trackID);
+    return;
   }
-  sprintf(SQL,"SELECT track_id FROM %s WHERE banned != 1%s AND track_id NOT IN( SELECT track_id FROM played ) ORDER BY RANDOM() LIMIT 1",from,WHERE);
 
-  sqlite3_prepare_v2(db, SQL, -1, &statement, NULL);
-  int step = sqlite3_step(statement);
+  SQL_exec("BEGIN");
+  for(int migration = version; migration < target; migration++)
+  {
+    SQL_migrations[migration]();
+  }
+  SQL = g_strdup_printf("PRAGMA user_version=%d",target);
+  SQL_exec(SQL);
+  g_free(SQL);
+
+  if(SQL_errors != errors)
+  {
+    printf("Failed to upgrade the database from schema %d to %d, leaving it as it was\n",version,target);
+    SQL_exec("ROLLBACK");
+    return;
+  }
+  SQL_exec("COMMIT");
+  // Tables may have been rebuilt, which leaves the pages of the old ones
+  // unused until the file is vacuumed
+  if(existing)
+  {
+    SQL_exec("VACUUM");
+  }
+  // The indexes may have changed, so give the query planner fresh statistics
+  SQL_exec("ANALYZE");
+}
 
-  trackID = sqlite3_column_int(statement,0);
+/*
+ * Switches a database that was created before auto_vacuum=INCREMENTAL to
+ * it. That takes a VACUUM, which rewrites the whole file, but only has to
+ * be done once.
+ */
+static void SQL_setAutoVacuum (void)
+{
+  sqlite3_stmt *statement;
+  int mode = -1;
 
+  sqlite3_prepare_v2(db, "PRAGMA auto_vacuum", -1, &statement, NULL);
+  if(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    mode = sqlite3_column_int(statement,0);
+  }
   sqlite3_finalize(statement);
 
-  if(step != SQLITE_ROW)
+  // 2 is INCREMENTAL
+  if(mode != -1 && mode != 2)
   {
-    return -1;
+    SQL_exec("VACUUM");
+  }
+}
+
+/*
+ * Initialize SQLite, creating the database if needed. Called during startup
+ */
+void SQLite_init (char *confDir)
+{
+  const char *FNAM = "randio.sqlite";
+  char *fpath;
+
+  fpath = malloc(strlen(confDir)+strlen(FNAM)+2);
+  sprintf(fpath,"%s/%s",confDir,FNAM);
+  // FIXME: Check if the DB was properly opened
+  if(sqlite3_config(SQLITE_CONFIG_SERIALIZED) != SQLITE_OK)
+  {
+    printf("Failed to set SQLite to SERIALIZED mode (required for threadsafety), expect trouble\n");
+  }
+  sqlite3_open(fpath, &db);
+  sqlite3_busy_timeout(db,SQL_BUSY_TIMEOUT);
+  // Lets removing tracks give space back without a full VACUUM. Only takes
+  // effect for new databases, SQL_setAutoVacuum() switches existing ones.
+  SQL_exec("PRAGMA auto_vacuum=INCREMENTAL");
+  // Lets the readers run alongside the writer. Syncing on every commit
+  // isn't needed in WAL mode, only on checkpoints, a crash can lose the
+  // last commit or so but won't corrupt anything.
+  SQL_exec("PRAGMA journal_mode=WAL");
+  SQL_exec("PRAGMA synchronous=NORMAL");
+  SQL_cacheInit(&writeCache);
+
+  SQL_migrate();
+  SQL_setAutoVacuum();
+  free(confDir);
+  dbPath = fpath;
+}
+
+/*
+ * Close the database. Called during shutdown, once nothing uses it any
+ * more.
+ */
+void SQL_close (void)
+{
+  // The other threads' readers were closed when they exited, but the
+  // thread closing the database may still have one
+  g_private_replace(&readerConnection,NULL);
+  SQL_cacheClear(&writeCache);
+  if(sqlite3_close(db) != SQLITE_OK)
+  {
+    printf("Failed to close the database: %s\n",sqlite3_errmsg(db));
   }
+  free(dbPath);
+  dbPath = NULL;
+}
+
+/*
+ * Retrieve a setting. Settings are changed with dbWriterSetSetting().
+ *
+ * Note: this function returns NULL if the setting does not exist,
+ * but it also returns NULL if the setting is set to NULL. A setting
+ * should never be set to NULL, but it is something to be aware of.
+ */
+unsigned char* SQL_getSetting (const char *setting)
+{
+  sqlite3_stmt *statement;
+  const unsigned char* sqliteValue;
+  unsigned char* value = NULL;
 
-  return trackID;
+  statement = SQL_prepare("SELECT value FROM settings WHERE name=?1");
+  sqlite3_bind_text(statement,1,setting,-1,NULL);
+  sqlite3_step(statement);
+  sqliteValue = sqlite3_column_text(statement,0);
+  if(sqliteValue != NULL)
+  {
+    value = (unsigned char*) strdup((char*) sqliteValue);
+  }
+  SQL_release(statement);
+  return value;
 }
 
 /*
@@ -180,8 +658,8 @@ int SQL_getTrackRND (bool playOnlyLoved, struct trackTag currTrack)
 void SQL_exec_1param (const char *SQL, const char *param)
 {
     sqlite3_stmt *statement;
-    sqlite3_prepare_v2(db,SQL,-1,&statement, NULL);
+    statement = SQL_prepare(SQL);
     sqlite3_bind_text(statement,1,param,-1,NULL);
     sqlite3_step(statement);
-    sqlite3_finalize(statement);
+    SQL_release(statement);
 }
@@ -5,5 +5,7 @@ void SQLite_init (char *confDir);
 void SQL_exec_1param (const char *SQL, const char *param);
 void initSQLite (void);
 unsigned char* SQL_getSetting (const char *setting);
-void SQL_setSetting (const char *key, const char *value);
-int SQL_getTrackRND (bool playOnlyLoved, struct trackTag currTrack);
+sqlite3_stmt *SQL_prepare (const char *SQL);
+sqlite3_stmt *SQL_prepareRead (const char *SQL);
+void SQL_release (sqlite3_stmt *statement);
+void SQL_close (void);
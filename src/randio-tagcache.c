@@ -0,0 +1,157 @@
+/*
+ * Randio music player
+ * Cache of track metadata
+ * Copyright (C) Eskild Hustvedt 2011, 2012, 2017
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include <sqlite3.h>
+
+#include "randio-datatypes.h"
+#include "randio-sql.h"
+#include "randio-dbwriter.h"
+#include "randio-tagcache.h"
+
+/*
+ * GStreamer only hands us the tags of a track once it has started reading
+ * it, so until then we'd have nothing to show. The tags table keeps the
+ * tags (and duration) of every track we've played, so that the next time
+ * it is played they are there from the start. An entry is only used if the
+ * mtime of the file is the same as when it was stored, if the file has
+ * been changed (ie. retagged) we wait for GStreamer again.
+ */
+
+/* Tags waiting to be stored by the writer */
+struct tagCacheEntry
+{
+  int trackID;
+  char *path;
+  /* Interned, so they're never freed */
+  const char *artist;
+  const char *title;
+  const char *album;
+  int duration;
+};
+
+/*
+ * Returns the mtime of path in nanoseconds, or 0 if it can't be stat()ed
+ */
+static gint64 tagCacheMtime (const char *path)
+{
+  struct stat info;
+  if(stat(path,&info) != 0)
+  {
+    return 0;
+  }
+  return info.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + info.st_mtim.tv_nsec;
+}
+
+/*
+ * Returns the path of the file track is playing, or NULL if it isn't a
+ * file
+ */
+static const char *tagCachePath (struct trackTag *track)
+{
+  if(track->trackID == -1 || track->currTrackPath == NULL || strncmp(track->currTrackPath,"file://",7) != 0)
+  {
+    return NULL;
+  }
+  return track->currTrackPath+7;
+}
+
+/*
+ * Fill in the tags of track from the cache, if we have them. track must
+ * not have been published yet. Returns true if it was filled in.
+ */
+bool tagCacheLoad (struct trackTag *track)
+{
+  const char *path = tagCachePath(track);
+  sqlite3_stmt *statement;
+  bool found = false;
+
+  if(path == NULL)
+  {
+    return false;
+  }
+
+  statement = SQL_prepareRead("SELECT mtime, artist, title, album, duration FROM tags WHERE track_id=?1");
+  sqlite3_bind_int(statement,1,track->trackID);
+  if(sqlite3_step(statement) == SQLITE_ROW && sqlite3_column_int64(statement,0) == tagCacheMtime(path))
+  {
+    track->trackArtist     = g_intern_string((const char*) sqlite3_column_text(statement,1));
+    track->trackName       = g_intern_string((const char*) sqlite3_column_text(statement,2));
+    track->hasAlbum        = sqlite3_column_type(statement,3) != SQLITE_NULL;
+    track->trackAlbum      = track->hasAlbum ? g_intern_string((const char*) sqlite3_column_text(statement,3)) : g_intern_static_string("Unknown album");
+    track->trackLenSeconds = sqlite3_column_int(statement,4);
+    track->hasBasicInfo    = true;
+    found = true;
+  }
+  SQL_release(statement);
+  return found;
+}
+
+/*
+ * Store an entry. Runs on the writer thread.
+ */
+static void tagCacheApply (struct tagCacheEntry *entry)
+{
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepare("INSERT OR REPLACE INTO tags (track_id, mtime, artist, title, album, duration) VALUES (?1, ?2, ?3, ?4, ?5, ?6)");
+  sqlite3_bind_int(statement,1,entry->trackID);
+  sqlite3_bind_int64(statement,2,tagCacheMtime(entry->path));
+  sqlite3_bind_text(statement,3,entry->artist,-1,NULL);
+  sqlite3_bind_text(statement,4,entry->title,-1,NULL);
+  sqlite3_bind_text(statement,5,entry->album,-1,NULL);
+  sqlite3_bind_int(statement,6,entry->duration);
+  sqlite3_step(statement);
+  SQL_release(statement);
+}
+
+static void tagCacheFreeEntry (struct tagCacheEntry *entry)
+{
+  free(entry->path);
+  free(entry);
+}
+
+/*
+ * Store the tags of track, if we know enough about it for them to be worth
+ * keeping. Should be called whenever they change.
+ */
+void tagCacheStore (struct trackTag *track)
+{
+  const char *path = tagCachePath(track);
+  struct tagCacheEntry *entry;
+
+  if(path == NULL || !track->hasBasicInfo)
+  {
+    return;
+  }
+  entry           = malloc(sizeof(struct tagCacheEntry));
+  entry->trackID  = track->trackID;
+  entry->path     = strdup(path);
+  entry->artist   = track->trackArtist;
+  entry->title    = track->trackName;
+  entry->album    = track->hasAlbum ? track->trackAlbum : NULL;
+  entry->duration = track->trackLenSeconds;
+  dbWriterPost((void (*) (gpointer)) tagCacheApply,entry,(GDestroyNotify) tagCacheFreeEntry);
+}
@@ -0,0 +1,2 @@
+bool tagCacheLoad (struct trackTag *track);
+void tagCacheStore (struct trackTag *track);
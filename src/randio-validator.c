@@ -0,0 +1,400 @@
+/*
+ * Randio music player
+ * Background validation of the library
+ * Copyright (C) Eskild Hustvedt 2011, 2012, 2017
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+
+#include <sqlite3.h>
+
+#include "randio-datatypes.h"
+#include "randio-sql.h"
+#include "randio-dbwriter.h"
+#include "randio-shuffle.h"
+#include "randio-library.h"
+#include "randio-validator.h"
+
+/*
+ * The validator slowly walks through every track in the library, checking
+ * that the file can still be read. Tracks that can't are flagged as missing,
+ * which keeps them out of the shuffle bag, and tracks that have come back
+ * are let back in. It does VALIDATOR_BATCH tracks at a time with a pause in
+ * between, so that it doesn't compete with playback for the disk, and once
+ * it has been through all of them it waits VALIDATOR_SWEEP_INTERVAL before
+ * starting over.
+ *
+ * It also looks after tracks that fail to play. Each failure is recorded in
+ * the failures table, and a track that has failed VALIDATOR_FAILURE_LIMIT
+ * times is left out of the shuffle bag until retry_after, which is set from
+ * the failureRetryHours setting (or VALIDATOR_DEFAULT_RETRY_HOURS). Once
+ * that has passed it is let back in for another try, a single failure after
+ * that puts it straight back out. Playing a track to the end clears its
+ * record.
+ *
+ * Library roots that have been detached because they were unavailable are
+ * checked every VALIDATOR_RETRY_INTERVAL, independently of the sweeps, and
+ * right away whenever something is mounted or unmounted.
+ */
+
+#define VALIDATOR_BATCH 100
+#define VALIDATOR_BATCH_PAUSE (2*G_TIME_SPAN_SECOND)
+#define VALIDATOR_START_DELAY (60*G_TIME_SPAN_SECOND)
+#define VALIDATOR_SWEEP_INTERVAL (6*G_TIME_SPAN_HOUR)
+#define VALIDATOR_RETRY_INTERVAL (60*G_TIME_SPAN_SECOND)
+#define VALIDATOR_FAILURE_LIMIT 3
+#define VALIDATOR_DEFAULT_RETRY_HOURS 24
+
+struct validatorTrack
+{
+  int trackID;
+  char *path;
+  bool missing;
+  bool loved;
+  int skips;
+  /* true if it is left out after failing to play, see validatorTrackFailed */
+  bool failing;
+};
+
+/* A playback failure, waiting to be recorded by the writer */
+struct validatorFailure
+{
+  int trackID;
+  char *domain;
+  int code;
+  char *message;
+};
+
+static GThread *validatorThread = NULL;
+static GMutex validatorLock;
+static GCond validatorWake;
+static bool validatorStopping = false;
+/* Set by validatorRetryDetached() */
+static bool validatorRetryWanted = false;
+/* /proc/self/mountinfo, which polls as readable whenever the mounts change */
+static int validatorMountsFd = -1;
+static guint validatorMountsSource = 0;
+
+/*
+ * Sleep until the monotonic time until, until we're told to stop, or until
+ * a retry of the detached roots is wanted. Returns false if we're stopping.
+ */
+static bool validatorSleep (gint64 until)
+{
+  bool running;
+
+  g_mutex_lock(&validatorLock);
+  while(!validatorStopping && !validatorRetryWanted && g_cond_wait_until(&validatorWake,&validatorLock,until))
+  {
+  }
+  running = !validatorStopping;
+  g_mutex_unlock(&validatorLock);
+  return running;
+}
+
+/*
+ * Fetch the next batch of tracks after lastID. The statement is finished
+ * before returning, so that we don't keep a read open while checking files.
+ */
+static GArray *validatorFetchBatch (int lastID)
+{
+  GArray *batch = g_array_new(FALSE,FALSE,sizeof(struct validatorTrack));
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepareRead("SELECT tracks.track_id, dir_id, name, missing, loved.track_id IS NOT NULL, skips, "
+      "tracks.track_id IN (SELECT track_id FROM failures WHERE retry_after > strftime('%s','now')) FROM tracks LEFT JOIN loved ON loved.track_id=tracks.track_id WHERE tracks.track_id > ?1 AND banned != 1 ORDER BY tracks.track_id LIMIT ?2");
+  sqlite3_bind_int(statement,1,lastID);
+  sqlite3_bind_int(statement,2,VALIDATOR_BATCH);
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    struct validatorTrack track;
+    track.trackID = sqlite3_column_int(statement,0);
+    track.path    = libraryPath(sqlite3_column_int(statement,1),(const char*) sqlite3_column_text(statement,2));
+    track.missing = sqlite3_column_int(statement,3) != 0;
+    track.loved   = sqlite3_column_int(statement,4) != 0;
+    track.skips   = sqlite3_column_int(statement,5);
+    track.failing = sqlite3_column_int(statement,6) != 0;
+    g_array_append_val(batch,track);
+  }
+  SQL_release(statement);
+  return batch;
+}
+
+/*
+ * Flag a track as missing, and stop it from being picked
+ */
+void validatorMarkMissing (int trackID)
+{
+  shuffleForgetTrack(trackID);
+  dbWriterExecInt("UPDATE tracks SET missing=1 WHERE track_id=?1",trackID);
+}
+
+/*
+ * Check a batch of tracks, updating those whose state has changed
+ */
+static void validatorCheckBatch (GArray *batch)
+{
+  for(guint i = 0; i < batch->len; i++)
+  {
+    struct validatorTrack *track = &g_array_index(batch,struct validatorTrack,i);
+    bool missing;
+
+    // Its directory was removed after the batch was fetched
+    if(track->path == NULL)
+    {
+      continue;
+    }
+    missing = g_access(track->path,R_OK) != 0;
+
+    // If the whole root is unavailable the root is detached instead
+    if(missing && !track->missing && libraryPathAvailable(track->path))
+    {
+      validatorMarkMissing(track->trackID);
+    }
+    else if(!missing && track->missing)
+    {
+      dbWriterExecInt("UPDATE tracks SET missing=0 WHERE track_id=?1",track->trackID);
+      // Tracks that are failing come back when validatorApplyRetry says so
+      if(!track->failing)
+      {
+        shuffleRestore(track->trackID,track->loved,track->skips);
+      }
+    }
+    free(track->path);
+  }
+}
+
+/*
+ * Record a playback failure. Runs on the writer thread.
+ */
+static void validatorApplyFailure (struct validatorFailure *failure)
+{
+  sqlite3_stmt *statement;
+  unsigned char *setting = SQL_getSetting("failureRetryHours");
+  gint64 retryHours = VALIDATOR_DEFAULT_RETRY_HOURS;
+  bool excluded = false;
+
+  if(setting != NULL)
+  {
+    retryHours = atoi((const char*) setting);
+    free(setting);
+  }
+
+  statement = SQL_prepare("INSERT INTO failures (track_id, domain, code, message, count, last_failed) VALUES (?1, ?2, ?3, ?4, 1, ?5) "
+      "ON CONFLICT (track_id) DO UPDATE SET domain=excluded.domain, code=excluded.code, message=excluded.message, count=count+1, last_failed=excluded.last_failed, "
+      "retry_after=CASE WHEN count+1 >= ?6 THEN ?5+?7 END RETURNING retry_after IS NOT NULL");
+  sqlite3_bind_int(statement,1,failure->trackID);
+  sqlite3_bind_text(statement,2,failure->domain,-1,NULL);
+  sqlite3_bind_int(statement,3,failure->code);
+  sqlite3_bind_text(statement,4,failure->message,-1,NULL);
+  sqlite3_bind_int64(statement,5,time(NULL));
+  sqlite3_bind_int(statement,6,VALIDATOR_FAILURE_LIMIT);
+  sqlite3_bind_int64(statement,7,retryHours*3600);
+  if(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    excluded = sqlite3_column_int(statement,0) != 0;
+  }
+  SQL_release(statement);
+
+  if(excluded)
+  {
+    printf("Track %d keeps failing to play, leaving it out for %" G_GINT64_FORMAT " hours\n",failure->trackID,retryHours);
+    shuffleForgetTrack(failure->trackID);
+  }
+}
+
+static void validatorFreeFailure (struct validatorFailure *failure)
+{
+  free(failure->domain);
+  free(failure->message);
+  free(failure);
+}
+
+/*
+ * A track failed to play with error
+ */
+void validatorTrackFailed (int trackID, const GError *error)
+{
+  struct validatorFailure *failure = malloc(sizeof(struct validatorFailure));
+  failure->trackID = trackID;
+  failure->domain  = strdup(g_quark_to_string(error->domain));
+  failure->code    = error->code;
+  failure->message = strdup(error->message);
+  dbWriterPost((void (*) (gpointer)) validatorApplyFailure,failure,(GDestroyNotify) validatorFreeFailure);
+}
+
+/*
+ * A track was played to the end, so whatever was wrong with it has been
+ * fixed
+ */
+void validatorTrackPlayed (int trackID)
+{
+  dbWriterExecInt("DELETE FROM failures WHERE track_id=?1",trackID);
+}
+
+/*
+ * Let tracks whose retry_after has passed back into the bag. Runs on the
+ * writer thread.
+ */
+static void validatorApplyRetry (gpointer data)
+{
+  sqlite3_stmt *statement;
+
+  statement = SQL_prepare("UPDATE failures SET retry_after=NULL WHERE retry_after <= ?1 "
+      "RETURNING track_id, track_id IN (SELECT track_id FROM loved), (SELECT skips FROM tracks WHERE tracks.track_id=failures.track_id), "
+      "EXISTS (SELECT 1 FROM tracks WHERE tracks.track_id=failures.track_id AND banned != 1 AND missing != 1)");
+  sqlite3_bind_int64(statement,1,time(NULL));
+  while(sqlite3_step(statement) == SQLITE_ROW)
+  {
+    if(sqlite3_column_int(statement,3))
+    {
+      shuffleRestore(sqlite3_column_int(statement,0),sqlite3_column_int(statement,1),sqlite3_column_int(statement,2));
+    }
+  }
+  SQL_release(statement);
+}
+
+/*
+ * Returns true if a retry of the detached roots has been asked for, and
+ * clears the request
+ */
+static bool validatorTakeRetry (void)
+{
+  bool wanted;
+
+  g_mutex_lock(&validatorLock);
+  wanted = validatorRetryWanted;
+  validatorRetryWanted = false;
+  g_mutex_unlock(&validatorLock);
+  return wanted;
+}
+
+/*
+ * The validator thread
+ */
+static gpointer validatorRun (gpointer user_data)
+{
+  int lastID = 0;
+  int checked = 0;
+  // Leave startup (and the rescan that happens during it) alone
+  gint64 nextBatch = g_get_monotonic_time()+VALIDATOR_START_DELAY;
+  gint64 nextRetry = g_get_monotonic_time()+VALIDATOR_RETRY_INTERVAL;
+
+  do
+  {
+    if(validatorTakeRetry() || g_get_monotonic_time() >= nextRetry)
+    {
+      libraryRetryDetachedRoots();
+      nextRetry = g_get_monotonic_time()+VALIDATOR_RETRY_INTERVAL;
+    }
+    if(g_get_monotonic_time() >= nextBatch)
+    {
+      GArray *batch = validatorFetchBatch(lastID);
+      bool done = batch->len == 0;
+
+      if(!done)
+      {
+        lastID = g_array_index(batch,struct validatorTrack,batch->len-1).trackID;
+        checked += batch->len;
+        validatorCheckBatch(batch);
+      }
+      g_array_free(batch,TRUE);
+
+      if(done)
+      {
+        printf("Checked %d tracks for missing files\n",checked);
+        dbWriterPost(validatorApplyRetry,NULL,NULL);
+        lastID  = 0;
+        checked = 0;
+      }
+      nextBatch = g_get_monotonic_time()+(done ? VALIDATOR_SWEEP_INTERVAL : VALIDATOR_BATCH_PAUSE);
+    }
+  } while(validatorSleep(MIN(nextBatch,nextRetry)));
+  return NULL;
+}
+
+/*
+ * Ask the validator to check the detached library roots right away. Safe
+ * to call from any thread.
+ */
+void validatorRetryDetached (void)
+{
+  g_mutex_lock(&validatorLock);
+  validatorRetryWanted = true;
+  g_cond_signal(&validatorWake);
+  g_mutex_unlock(&validatorLock);
+}
+
+/*
+ * Called by the main loop when something has been mounted or unmounted
+ */
+static gboolean validatorMountsChanged (gint fd, GIOCondition condition, gpointer user_data)
+{
+  validatorRetryDetached();
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Start the validator. Called during startup.
+ */
+void validatorInit (void)
+{
+  validatorThread = g_thread_new("validator",validatorRun,NULL);
+
+  // Without it we only find out once VALIDATOR_RETRY_INTERVAL has passed
+  validatorMountsFd = open("/proc/self/mountinfo",O_RDONLY|O_CLOEXEC);
+  if(validatorMountsFd != -1)
+  {
+    validatorMountsSource = g_unix_fd_add(validatorMountsFd,G_IO_PRI|G_IO_ERR,validatorMountsChanged,NULL);
+  }
+}
+
+/*
+ * Stop the validator, waiting for it to finish what it's doing. Must be
+ * called before the database writer is shut down.
+ */
+void validatorShutdown (void)
+{
+  if(validatorMountsSource != 0)
+  {
+    g_source_remove(validatorMountsSource);
+    validatorMountsSource = 0;
+  }
+  if(validatorMountsFd != -1)
+  {
+    close(validatorMountsFd);
+    validatorMountsFd = -1;
+  }
+  if(validatorThread == NULL)
+  {
+    return;
+  }
+  g_mutex_lock(&validatorLock);
+  validatorStopping = true;
+  g_cond_signal(&validatorWake);
+  g_mutex_unlock(&validatorLock);
+  g_thread_join(validatorThread);
+  validatorThread = NULL;
+}
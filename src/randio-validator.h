@@ -0,0 +1,6 @@
+void validatorMarkMissing (int trackID);
+void validatorTrackFailed (int trackID, const GError *error);
+void validatorTrackPlayed (int trackID);
+void validatorRetryDetached (void);
+void validatorInit (void);
+void validatorShutdown (void);
@@ -0,0 +1,422 @@
+/*
+ * Randio music player
+ * Library watcher
+ * Copyright (C) Eskild Hustvedt 2011, 2012, 2017
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include <sqlite3.h>
+
+#include "randio-datatypes.h"
+#include "randio-sql.h"
+#include "randio-library.h"
+#include "randio-watcher.h"
+
+/*
+ * The watcher keeps an inotify watch on every directory in the library. When
+ * something is added to, removed from or moved in or out of a directory, that
+ * directory is marked as dirty. Once things have been quiet for a little
+ * while (so that copying in a whole album results in one update rather than
+ * one per file), the dirty directories are rescanned by libraryScan(), which
+ * only reads the directories that actually changed.
+ *
+ * If we run out of inotify watches we give up on inotify and rescan the whole
+ * library periodically instead, which is cheap since unchanged directories
+ * are skipped.
+ */
+
+/* The events that change the contents of a directory */
+#define WATCHER_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+/* Rescan once no events have arrived for this long */
+#define WATCHER_QUIET_USEC (2*G_TIME_SPAN_SECOND)
+/* ..but never wait longer than this after the first event */
+#define WATCHER_MAX_DELAY_USEC (30*G_TIME_SPAN_SECOND)
+/* How often to rescan when polling */
+#define WATCHER_POLL_SECONDS 300
+
+/* True while inotify is in use */
+static gint watcherActive = false;
+static int watcherFd = -1;
+static guint watcherSource = 0;
+static guint watcherFlushSource = 0;
+static guint watcherPollSource = 0;
+/* Protects the two tables below, directories are added from scan threads */
+static GMutex watcherLock;
+/* path => watch descriptor */
+static GHashTable *watchedPaths = NULL;
+/* watch descriptor => path (owned by watchedPaths) */
+static GHashTable *watchDescriptors = NULL;
+/* Directories with changes that haven't been rescanned yet. Only touched
+ * from the main loop */
+static GHashTable *dirtyDirs = NULL;
+static gint64 firstDirty = 0;
+static gint64 lastDirty = 0;
+
+/*
+ * Rescan every directory in the library periodically. Used when inotify
+ * isn't available
+ */
+static gboolean watcherPoll (gpointer user_data)
+{
+  libraryRescanInBackground();
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Tear down everything inotify related
+ */
+static void watcherStopInotify (void)
+{
+  if(watcherSource == 0)
+  {
+    return;
+  }
+  g_atomic_int_set(&watcherActive,false);
+
+  g_source_remove(watcherSource);
+  watcherSource = 0;
+  if(watcherFlushSource != 0)
+  {
+    g_source_remove(watcherFlushSource);
+    watcherFlushSource = 0;
+  }
+
+  g_mutex_lock(&watcherLock);
+  // Closing the descriptor drops all of the watches
+  close(watcherFd);
+  watcherFd = -1;
+  g_hash_table_destroy(watchDescriptors);
+  g_hash_table_destroy(watchedPaths);
+  watchDescriptors = NULL;
+  watchedPaths     = NULL;
+  g_mutex_unlock(&watcherLock);
+
+  g_hash_table_destroy(dirtyDirs);
+  dirtyDirs  = NULL;
+  firstDirty = 0;
+}
+
+/*
+ * Switch from inotify to polling
+ */
+static gboolean watcherStartPolling (gpointer user_data)
+{
+  watcherStopInotify();
+  if(watcherPollSource == 0)
+  {
+    watcherPollSource = g_timeout_add_seconds(WATCHER_POLL_SECONDS,watcherPoll,NULL);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Rescan the directories in the GPtrArray dirs. Runs in a thread.
+ */
+static gpointer watcherRescan (GPtrArray *dirs)
+{
+  for(guint i = 0; i < dirs->len; i++)
+  {
+    libraryScan(g_ptr_array_index(dirs,i),NULL,NULL);
+  }
+  g_ptr_array_free(dirs,TRUE);
+  return NULL;
+}
+
+/*
+ * Checks if any of the parents of path are dirty
+ */
+static bool watcherParentIsDirty (const char *path)
+{
+  char *parent = strdup(path);
+  char *slash;
+  bool dirty = false;
+
+  while(!dirty && (slash = strrchr(parent,'/')) != NULL && slash != parent)
+  {
+    *slash = 0;
+    dirty  = g_hash_table_contains(dirtyDirs,parent);
+  }
+  free(parent);
+  return dirty;
+}
+
+/*
+ * Runs periodically while there are dirty directories, and starts a rescan
+ * of them once things have calmed down
+ */
+static gboolean watcherFlush (gpointer user_data)
+{
+  gint64 now = g_get_monotonic_time();
+  GPtrArray *dirs;
+  GHashTableIter iter;
+  gpointer key;
+
+  if(now-lastDirty < WATCHER_QUIET_USEC && now-firstDirty < WATCHER_MAX_DELAY_USEC)
+  {
+    return G_SOURCE_CONTINUE;
+  }
+
+  dirs = g_ptr_array_new_with_free_func(free);
+  g_hash_table_iter_init(&iter,dirtyDirs);
+  while(g_hash_table_iter_next(&iter,&key,NULL))
+  {
+    // A rescan of the parent will find any changes here too
+    if(!watcherParentIsDirty(key))
+    {
+      g_ptr_array_add(dirs,strdup(key));
+    }
+  }
+  g_hash_table_remove_all(dirtyDirs);
+  firstDirty         = 0;
+  watcherFlushSource = 0;
+
+  if(!libraryThreadNew("watcherRescan", (GThreadFunc) watcherRescan,dirs))
+  {
+    g_ptr_array_free(dirs,TRUE);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Called by the main loop when there are inotify events to read
+ */
+static gboolean watcherRead (gint fd, GIOCondition condition, gpointer user_data)
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *event;
+  ssize_t len;
+  bool sawChange = false;
+
+  while( (len = read(fd,buf,sizeof(buf))) > 0 )
+  {
+    for(char *ptr = buf; ptr < buf+len; ptr += sizeof(struct inotify_event)+event->len)
+    {
+      const char *path;
+      event = (const struct inotify_event *) ptr;
+
+      // The kernel dropped events, so we have no idea what changed
+      if(event->mask & IN_Q_OVERFLOW)
+      {
+        libraryRescanInBackground();
+        continue;
+      }
+
+      g_mutex_lock(&watcherLock);
+      path = g_hash_table_lookup(watchDescriptors,GINT_TO_POINTER(event->wd));
+      if(path != NULL)
+      {
+        // The directory is gone, the change is picked up through its parent
+        if(event->mask & IN_IGNORED)
+        {
+          g_hash_table_remove(watchDescriptors,GINT_TO_POINTER(event->wd));
+          g_hash_table_remove(watchedPaths,path);
+        }
+        else
+        {
+          g_hash_table_add(dirtyDirs,strdup(path));
+          sawChange = true;
+        }
+      }
+      g_mutex_unlock(&watcherLock);
+    }
+  }
+
+  if(sawChange)
+  {
+    lastDirty = g_get_monotonic_time();
+    if(firstDirty == 0)
+    {
+      firstDirty = lastDirty;
+    }
+    if(watcherFlushSource == 0)
+    {
+      watcherFlushSource = g_timeout_add(500,watcherFlush,NULL);
+    }
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Start watching a directory. Called by libraryScan for every directory it
+ * visits, and safe to call from any thread. Does nothing unless the watcher
+ * is running.
+ */
+void watcherAddDirectory (const char *path)
+{
+  int wd;
+  const char *previous;
+
+  if(!g_atomic_int_get(&watcherActive))
+  {
+    return;
+  }
+
+  g_mutex_lock(&watcherLock);
+  if(watchedPaths == NULL || g_hash_table_contains(watchedPaths,path))
+  {
+    g_mutex_unlock(&watcherLock);
+    return;
+  }
+
+  wd = inotify_add_watch(watcherFd,path,WATCHER_EVENTS);
+  if(wd == -1)
+  {
+    if(errno == ENOSPC)
+    {
+      printf("Ran out of inotify watches, polling the library for changes instead\n");
+      // Once is enough
+      g_atomic_int_set(&watcherActive,false);
+      g_idle_add(watcherStartPolling,NULL);
+    }
+    g_mutex_unlock(&watcherLock);
+    return;
+  }
+
+  // The same directory under another name (ie. it has been moved)
+  previous = g_hash_table_lookup(watchDescriptors,GINT_TO_POINTER(wd));
+  if(previous != NULL)
+  {
+    g_hash_table_remove(watchedPaths,previous);
+  }
+
+  previous = strdup(path);
+  g_hash_table_insert(watchedPaths,(gpointer) previous,GINT_TO_POINTER(wd));
+  g_hash_table_insert(watchDescriptors,GINT_TO_POINTER(wd),(gpointer) previous);
+  g_mutex_unlock(&watcherLock);
+}
+
+/*
+ * Returns true if path is dir, or below it
+ */
+static bool watcherIsBelow (const char *path, const char *dir)
+{
+  size_t len = strlen(dir);
+  return strncmp(path,dir,len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/*
+ * Stop watching root, which has been removed from the library, and the
+ * directories below it. Those below nested, the roots inside root that are
+ * still in the library, are kept. Safe to call from any thread.
+ */
+void watcherRemoveRoot (const char *root, GPtrArray *nested)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  g_mutex_lock(&watcherLock);
+  if(watchedPaths != NULL)
+  {
+    g_hash_table_iter_init(&iter,watchedPaths);
+    while(g_hash_table_iter_next(&iter,&key,&value))
+    {
+      bool keep = !watcherIsBelow(key,root);
+      for(guint i = 0; !keep && i < nested->len; i++)
+      {
+        keep = watcherIsBelow(key,g_ptr_array_index(nested,i));
+      }
+      if(!keep)
+      {
+        // The IN_IGNORED event this causes is for a watch we no longer know
+        inotify_rm_watch(watcherFd,GPOINTER_TO_INT(value));
+        g_hash_table_remove(watchDescriptors,value);
+        g_hash_table_iter_remove(&iter);
+      }
+    }
+  }
+  g_mutex_unlock(&watcherLock);
+}
+
+/*
+ * Adds watches for every directory we know about. Runs in a thread.
+ */
+static gpointer watcherAddAll (gpointer user_data)
+{
+  GPtrArray *dirs = libraryDirectories();
+
+  for(guint i = 0; i < dirs->len; i++)
+  {
+    watcherAddDirectory(g_ptr_array_index(dirs,i));
+  }
+  g_ptr_array_free(dirs,TRUE);
+  return NULL;
+}
+
+/*
+ * Start watching the library
+ */
+void watcherStart (void)
+{
+  if(g_atomic_int_get(&watcherActive) || watcherPollSource != 0)
+  {
+    return;
+  }
+
+  watcherFd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if(watcherFd == -1)
+  {
+    printf("Unable to initialize inotify (%s), polling the library for changes instead\n",strerror(errno));
+    watcherStartPolling(NULL);
+    return;
+  }
+
+  watchedPaths     = g_hash_table_new_full(g_str_hash,g_str_equal,free,NULL);
+  watchDescriptors = g_hash_table_new(g_direct_hash,g_direct_equal);
+  dirtyDirs        = g_hash_table_new_full(g_str_hash,g_str_equal,free,NULL);
+  watcherSource    = g_unix_fd_add(watcherFd,G_IO_IN,watcherRead,NULL);
+  g_atomic_int_set(&watcherActive,true);
+
+  libraryThreadNew("watcherAddAll", watcherAddAll,NULL);
+}
+
+/*
+ * Stop watching the library
+ */
+void watcherStop (void)
+{
+  watcherStopInotify();
+  if(watcherPollSource != 0)
+  {
+    g_source_remove(watcherPollSource);
+    watcherPollSource = 0;
+  }
+}
+
+/*
+ * Start the watcher if it has been enabled. Called during startup
+ */
+void watcherInit (void)
+{
+  unsigned char *enabled = SQL_getSetting("watchLibrary");
+  if(enabled != NULL)
+  {
+    if(strcmp((char*) enabled,"1") == 0)
+    {
+      watcherStart();
+    }
+    free(enabled);
+  }
+}
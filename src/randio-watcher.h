@@ -0,0 +1,5 @@
+void watcherAddDirectory (const char *path);
+void watcherRemoveRoot (const char *root, GPtrArray *nested);
+void watcherStart (void);
+void watcherStop (void);
+void watcherInit (void);
@@ -21,6 +21,7 @@
 #include <gio/gio.h>
 
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
 
 #include <rest-extras/lastfm-proxy.h>
 
@@ -37,6 +38,13 @@
 #include "randio-prefs.h"
 #include "randio-lastfm.h"
 #include "randio-sql.h"
+#include "randio-library.h"
+#include "randio-watcher.h"
+#include "randio-dbwriter.h"
+#include "randio-shuffle.h"
+#include "randio-prefetch.h"
+#include "randio-validator.h"
+#include "randio-tagcache.h"
 #include "randio.h"
 
 /* Global widgets */
@@ -46,8 +54,11 @@ GtkWidget *playStopButton;
 GtkWidget *timeWidget;
 /* The GStreamer pipeline */
 GstElement *pipeline;
-/* Structure tracking track info. The struct i defined in randio-datatypes.h */
-struct trackTag currTrack;
+/* The track that is playing. The struct is defined in randio-datatypes.h,
+ * use trackGetCurrent() to get at it. currTrackLock is only held while
+ * swapping it or taking a reference, never while using it. */
+static struct trackTag *currTrack = NULL;
+static GMutex currTrackLock;
 /* Our global state, contains the main window, the GtkApplication and our GtkBuilder */
 struct randioGlobalStateStruct randioGlobalState;
 
@@ -62,6 +73,84 @@ bool statePlaying = false;
 /* This is a global notification variable. This is kept so that we can
  * notify_notification_close() it before displaying a new one */
 GNotification *notification = NULL;
+/* Set when the user asked us to play but the library was empty. The next
+ * commit by the database writer (ie. a scan finding tracks) will then start
+ * playback. Accessed atomically since it's read on the writer thread */
+gint waitingForTracks = 0;
+
+/* The next track, picked and checked ahead of time so that we can switch to
+ * it without a gap. preparedTrack is its snapshot, with the cached tags
+ * filled in (see trackLoad), NULL if nothing has been prepared.
+ * preparedData is the whole track, if it is to be played from memory. */
+static struct trackTag *preparedTrack = NULL;
+static char *preparedPath = NULL;
+static GBytes *preparedData = NULL;
+/* The track handed to playbin in aboutToFinish, which becomes currTrack once
+ * it actually starts playing. NULL if there is none. */
+static struct trackTag *gaplessTrack = NULL;
+/* The data that the next appsrc playbin creates should be fed from, see
+ * sourceSetup */
+static GBytes *sourceData = NULL;
+/* Protects the variables above */
+static GMutex preparedLock;
+/* Set while prepareNextTrackInThread is running */
+static gint preparingTrack = 0;
+/* The thread that last ran it, joined before the next one is started (and
+ * during shutdown). Protected by prepareThreadLock. */
+static GThread *prepareThread = NULL;
+static GMutex prepareThreadLock;
+
+/* Set once we've reacted to a playback error, so that the errors that
+ * follow it (often more than one element reports the same problem) don't
+ * skip past more tracks. Cleared when a new track starts. */
+static gint failureHandled = 0;
+
+/* Parts of the window that need refreshing, see uiRequestUpdate */
+#define UI_UPDATE_LABEL (1 << 0)
+#define UI_UPDATE_STATE (1 << 1)
+#define UI_UPDATE_NOTIFICATION (1 << 2)
+/* How long to collect update requests for, about one frame */
+#define UI_UPDATE_INTERVAL 16
+static gint uiPendingUpdates = 0;
+
+/*
+ * Commands for the playback controller. The UI, media keys and the bus
+ * handler queue these, and the controller thread is the only thing that
+ * switches tracks or changes the pipeline state.
+ */
+enum playbackCommand
+{
+  PLAYBACK_NEXT,
+  PLAYBACK_SKIP,
+  PLAYBACK_BAN,
+  PLAYBACK_LOVE,
+  PLAYBACK_TOGGLE,
+  PLAYBACK_STOP
+};
+
+struct playbackRequest
+{
+  enum playbackCommand command;
+  /* The track that was playing when the command was given */
+  int trackID;
+  /* When it was given, in monotonic time */
+  gint64 requested;
+};
+
+static GQueue playbackQueue = G_QUEUE_INIT;
+static GThread *playbackThread = NULL;
+/* Protects playbackQueue and the statistics below */
+static GMutex playbackLock;
+static GCond playbackPending;
+/* When the oldest request behind the track switch that is underway was
+ * made, 0 if there is none. Used to measure how long it takes from a
+ * command until the new track starts. */
+static gint64 switchRequested = 0;
+static int switchCount = 0;
+static gint64 switchTotalUsec = 0;
+static gint64 switchMaxUsec = 0;
+
+static void playbackPost (enum playbackCommand command);
 
 /*
  * ******************
@@ -70,67 +159,526 @@ GNotification *notification = NULL;
  */
 
 /*
- * Play a track, identified by the track id number supplied
+ * Create a snapshot of trackID, playing uri (which is copied, and can be
+ * NULL)
  */
-bool playTrack (int trackID)
+struct trackTag *trackNew (int trackID, const char *uri)
 {
-  char SQL[254];
-  sqlite3_stmt *statement;
-  const char *track;
-  char *path;
+  struct trackTag *track = g_new0(struct trackTag,1);
+  track->refs = 1;
+  track->trackID = trackID;
+  track->currTrackPath = g_strdup(uri);
+  return track;
+}
 
-  sprintf(SQL,"SELECT path FROM tracks WHERE track_id=%d",trackID);
-  sqlite3_prepare_v2(db, SQL, -1, &statement, NULL);
-  sqlite3_step(statement);
-  track = strdup((char*) sqlite3_column_text(statement,0));
-  sqlite3_finalize(statement);
+/*
+ * Create the snapshot of trackID, which is about to be played from path,
+ * with its tags filled in from the cache if we have them. Looking them up
+ * stats the file, so this is done when the track is picked rather than on
+ * the main thread once it starts.
+ */
+struct trackTag *trackLoad (int trackID, const char *path)
+{
+  char *uri = g_strconcat("file://",path,NULL);
+  struct trackTag *track = trackNew(trackID,uri);
+  g_free(uri);
+  tagCacheLoad(track);
+  return track;
+}
 
-  path = malloc(7+strlen(track)+1);
-  sprintf(path,"file://%s",track);
-  playFile(path);
+/*
+ * Create a copy of track, to be changed and published in its place
+ */
+struct trackTag *trackCopy (struct trackTag *track)
+{
+  struct trackTag *copy = trackNew(track->trackID,track->currTrackPath);
+  copy->trackName       = track->trackName;
+  copy->trackArtist     = track->trackArtist;
+  copy->trackAlbum      = track->trackAlbum;
+  copy->trackLenSeconds = track->trackLenSeconds;
+  copy->startedPlaying  = track->startedPlaying;
+  copy->hasBasicInfo    = track->hasBasicInfo;
+  copy->hasAlbum        = track->hasAlbum;
+  copy->flags           = g_atomic_int_get(&track->flags);
+  return copy;
+}
 
-  // Get the lock so we can write to currTrack
-  g_mutex_lock(&currTrack.lock);
+struct trackTag *trackRef (struct trackTag *track)
+{
+  g_atomic_int_inc(&track->refs);
+  return track;
+}
 
-  currTrack.trackID = trackID;
-  currTrack.startedPlaying = time(NULL);
-  if(currTrack.currTrackPath)
+void trackUnref (struct trackTag *track)
+{
+  if(track != NULL && g_atomic_int_dec_and_test(&track->refs))
   {
-    free(currTrack.currTrackPath);
+    g_free(track->currTrackPath);
+    g_free(track);
   }
-  currTrack.currTrackPath = path;
+}
 
-  g_mutex_unlock(&currTrack.lock);
+/*
+ * Returns a reference to the track that is playing, release it with
+ * trackUnref()
+ */
+struct trackTag *trackGetCurrent (void)
+{
+  struct trackTag *track;
+  g_mutex_lock(&currTrackLock);
+  track = trackRef(currTrack);
+  g_mutex_unlock(&currTrackLock);
+  return track;
+}
 
-  /*
-   * Yes, by this time gstreamer has probably already errored out,
-   * but stats can be quite slow (ie. over nfs), so performing the check
-   * afterwards gives a better interactive feel most of the time.
-   *
-   * The result is that tracks start playing sooner as long as the
-   * track exists, if it doesn't then we handle it here.
-   */
-  if (g_access(track,R_OK) != 0)
+/*
+ * Returns the ID of the track that is playing, -1 if there is none
+ */
+int trackCurrentID (void)
+{
+  struct trackTag *track = trackGetCurrent();
+  int trackID = track->trackID;
+  trackUnref(track);
+  return trackID;
+}
+
+/*
+ * Publish track as the one that is playing. Takes ownership of track.
+ *
+ * If previous isn't NULL, track is only published if previous is still
+ * current (ie. track is an update of it, and we haven't moved on to another
+ * track in the meantime). Returns false if it wasn't published.
+ */
+bool trackSetCurrent (struct trackTag *track, struct trackTag *previous)
+{
+  struct trackTag *old;
+
+  g_mutex_lock(&currTrackLock);
+  old = currTrack;
+  if(previous != NULL && previous != old)
+  {
+    g_mutex_unlock(&currTrackLock);
+    trackUnref(track);
     return false;
+  }
+  currTrack = track;
+  g_mutex_unlock(&currTrackLock);
+  trackUnref(old);
+  return true;
+}
 
-  sprintf(SQL, "INSERT INTO played (track_id) VALUES (%d)",trackID);
-  SQL_exec(SQL);
+/*
+ * Pick a random track that exists on disk, avoiding skip. Returns false if
+ * we couldn't find one. Tracks that turn out to be missing are flagged, so
+ * that they aren't picked again (the validator normally gets to them first).
+ * If it's the whole library root that is missing, the root is detached.
+ *
+ * Checking that the file exists can be slow (ie. over nfs), which is why
+ * this is normally done ahead of time by prepareNextTrack.
+ */
+bool pickTrack (int skip, int *trackID, char **path)
+{
+  for(int attempt = 0; attempt < 10; attempt++)
+  {
+    *trackID = shuffleNext(shuffleTracks, skip);
+    if(*trackID == -1)
+    {
+      return false;
+    }
+    *path = libraryTrackPath(*trackID);
+    if(*path != NULL && g_access(*path,R_OK) == 0)
+    {
+      return true;
+    }
+    if(*path != NULL && libraryPathAvailable(*path))
+    {
+      validatorMarkMissing(*trackID);
+    }
+    free(*path);
+  }
+  return false;
+}
 
+/*
+ * Take the prepared track, if there is one that is still in the library.
+ * data is set to the contents of the track if it is to be played from
+ * memory, NULL otherwise.
+ */
+bool takePreparedTrack (struct trackTag **track, char **path, GBytes **data)
+{
+  g_mutex_lock(&preparedLock);
+  *track = preparedTrack;
+  *path  = preparedPath;
+  *data  = preparedData;
+  preparedTrack = NULL;
+  preparedPath  = NULL;
+  preparedData  = NULL;
+  g_mutex_unlock(&preparedLock);
+
+  // It might have been banned or removed since it was picked
+  if(*track != NULL && !shuffleContains(shuffleTracks,(*track)->trackID))
+  {
+    trackUnref(*track);
+    free(*path);
+    if(*data != NULL)
+    {
+      g_bytes_unref(*data);
+      *data = NULL;
+    }
+    *track = NULL;
+  }
+  return *track != NULL;
+}
+
+/*
+ * Take the prepared track, or pick one if there isn't any. Returns false if
+ * there is nothing to play.
+ */
+bool takeNextTrack (struct trackTag **track, char **path, GBytes **data)
+{
+  int trackID;
+
+  if(takePreparedTrack(track,path,data))
+  {
+    return true;
+  }
+  if(!pickTrack(trackCurrentID(),&trackID,path))
+  {
+    return false;
+  }
+  *track = trackLoad(trackID,*path);
   return true;
 }
 
+/*
+ * Pick and check the track to play after the current one
+ */
+void prepareNextTrackInThread (void)
+{
+  int trackID;
+  char *path;
+  GBytes *data;
+  bool havePrepared;
+
+  g_mutex_lock(&preparedLock);
+  havePrepared = preparedTrack != NULL;
+  g_mutex_unlock(&preparedLock);
+
+  if(!havePrepared && pickTrack(trackCurrentID(),&trackID,&path))
+  {
+    // Make it available right away, the read-ahead is only a bonus
+    char *warm = strdup(path);
+    struct trackTag *track = trackLoad(trackID,path);
+    g_mutex_lock(&preparedLock);
+    trackUnref(preparedTrack);
+    free(preparedPath);
+    if(preparedData != NULL)
+    {
+      g_bytes_unref(preparedData);
+      preparedData = NULL;
+    }
+    preparedTrack = track;
+    preparedPath  = path;
+    g_mutex_unlock(&preparedLock);
+
+    data = prefetchTrack(warm);
+    if(data != NULL)
+    {
+      g_mutex_lock(&preparedLock);
+      if(preparedTrack != NULL && preparedTrack->trackID == trackID && preparedData == NULL)
+      {
+        preparedData = data;
+        data = NULL;
+      }
+      g_mutex_unlock(&preparedLock);
+      // Already taken, it's being played from disk
+      if(data != NULL)
+      {
+        g_bytes_unref(data);
+      }
+    }
+    free(warm);
+  }
+  g_atomic_int_set(&preparingTrack,0);
+}
+
+/*
+ * Runs prepareNextTrackInThread in a thread, unless it's already running
+ */
+void prepareNextTrack (void)
+{
+  if(g_atomic_int_compare_and_exchange(&preparingTrack,0,1))
+  {
+    g_mutex_lock(&prepareThreadLock);
+    // It has finished, or preparingTrack would still be set
+    if(prepareThread != NULL)
+    {
+      g_thread_join(prepareThread);
+    }
+    prepareThread = g_thread_new("prepareNextTrack", (GThreadFunc) prepareNextTrackInThread,NULL);
+    g_mutex_unlock(&prepareThreadLock);
+  }
+}
+
+/*
+ * Wait for prepareNextTrackInThread to finish, cutting its read-ahead
+ * short. Called during shutdown, once playback has stopped, so that nothing
+ * can start it again.
+ */
+static void prepareShutdown (void)
+{
+  prefetchCancel();
+  g_mutex_lock(&prepareThreadLock);
+  if(prepareThread != NULL)
+  {
+    g_thread_join(prepareThread);
+    prepareThread = NULL;
+  }
+  g_mutex_unlock(&prepareThreadLock);
+}
+
+/*
+ * Publish track, from trackLoad(), as the new current track, one that has
+ * just started. Takes ownership of track. If we've played it before its
+ * tags are shown right away, rather than once GStreamer has found them.
+ */
+void setCurrentTrack (struct trackTag *track)
+{
+  bool cached = track->hasBasicInfo;
+  track->startedPlaying = time(NULL);
+  trackSetCurrent(track,NULL);
+  uiRequestUpdate(cached ? UI_UPDATE_LABEL|UI_UPDATE_NOTIFICATION : UI_UPDATE_LABEL);
+}
+
+/*
+ * Make the next appsrc created by playbin play data. Takes ownership of
+ * data. Must be called with preparedLock held.
+ */
+void setSourceData (GBytes *data)
+{
+  if(sourceData != NULL)
+  {
+    g_bytes_unref(sourceData);
+  }
+  sourceData = data;
+}
+
+/*
+ * Play track, from trackLoad(), which is stored at path. Takes ownership of
+ * all three, data if not NULL is the contents of the track and is played
+ * from memory.
+ */
+void playTrack (struct trackTag *track, char *path, GBytes *data)
+{
+  prefetchTrackStarting(path);
+  free(path);
+
+  // Anything queued up by aboutToFinish is superseded by this
+  g_mutex_lock(&preparedLock);
+  trackUnref(gaplessTrack);
+  gaplessTrack = NULL;
+  setSourceData(data);
+  g_mutex_unlock(&preparedLock);
+
+  playFile(data != NULL ? "appsrc://" : track->currTrackPath);
+  setCurrentTrack(track);
+  g_atomic_int_set(&failureHandled,0);
+  prepareNextTrack();
+}
+
+/*
+ * Called by playbin (in a streaming thread) when it is about to run out of
+ * data. Handing it the next track now lets it switch over without a gap.
+ */
+void aboutToFinish (GstElement *playbin, gpointer user_data)
+{
+  struct trackTag *track;
+  char *path;
+  GBytes *data = NULL;
+
+  if(!takeNextTrack(&track,&path,&data))
+  {
+    // Nothing to play, we'll get EOS instead
+    return;
+  }
+
+  g_mutex_lock(&preparedLock);
+  trackUnref(gaplessTrack);
+  gaplessTrack = track;
+  setSourceData(data);
+  g_object_set(G_OBJECT(playbin), "uri", data != NULL ? "appsrc://" : track->currTrackPath, NULL);
+  g_mutex_unlock(&preparedLock);
+  prefetchTrackStarting(path);
+  free(path);
+}
+
+/*
+ * Feeds an appsrc from a track held in memory
+ */
+struct memoryFeed
+{
+  GBytes *data;
+  guint64 offset;
+};
+
+static void memoryFeedFree (struct memoryFeed *feed)
+{
+  g_bytes_unref(feed->data);
+  free(feed);
+}
+
+/*
+ * appsrc wants more data. The buffers we push refer to the memory the track
+ * is held in rather than copying it, and keep it alive until they are done.
+ */
+static void memoryFeedNeedData (GstAppSrc *source, guint length, struct memoryFeed *feed)
+{
+  gsize size;
+  gsize chunk;
+  GstBuffer *buffer;
+  const guint8 *bytes = g_bytes_get_data(feed->data,&size);
+
+  if(feed->offset >= size)
+  {
+    gst_app_src_end_of_stream(source);
+    return;
+  }
+  chunk  = MIN(size-feed->offset,64*1024);
+  buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,(gpointer) bytes,size,feed->offset,chunk,
+      g_bytes_ref(feed->data),(GDestroyNotify) g_bytes_unref);
+  GST_BUFFER_OFFSET(buffer) = feed->offset;
+  feed->offset += chunk;
+  gst_app_src_push_buffer(source,buffer);
+}
+
+static gboolean memoryFeedSeekData (GstAppSrc *source, guint64 offset, struct memoryFeed *feed)
+{
+  feed->offset = offset;
+  return TRUE;
+}
+
+/*
+ * playbin has created the source element for a new URI. If it is the
+ * appsrc for a track that we are playing from memory, hook it up to the
+ * data. The data is released (and its memory returned to the budget) when
+ * playbin disposes of the source once the track is done.
+ */
+void sourceSetup (GstElement *playbin, GstElement *source, gpointer user_data)
+{
+  struct memoryFeed *feed;
+  GBytes *data;
+
+  g_mutex_lock(&preparedLock);
+  data = sourceData;
+  sourceData = NULL;
+  g_mutex_unlock(&preparedLock);
+
+  if(data == NULL)
+  {
+    return;
+  }
+  if(!GST_IS_APP_SRC(source))
+  {
+    g_bytes_unref(data);
+    return;
+  }
+
+  feed = malloc(sizeof(struct memoryFeed));
+  feed->data   = data;
+  feed->offset = 0;
+  g_object_set(G_OBJECT(source),
+      "stream-type", GST_APP_STREAM_TYPE_RANDOM_ACCESS,
+      "format", GST_FORMAT_BYTES,
+      "size", (gint64) g_bytes_get_size(data),
+      NULL);
+  g_signal_connect(source, "need-data", G_CALLBACK(memoryFeedNeedData), feed);
+  g_signal_connect(source, "seek-data", G_CALLBACK(memoryFeedSeekData), feed);
+  g_object_set_data_full(G_OBJECT(source), "randio-memory-feed", feed, (GDestroyNotify) memoryFeedFree);
+}
+
+/*
+ * Bookkeeping for a track that was played to the end
+ */
+void trackFinished (void)
+{
+  struct trackTag *track = trackGetCurrent();
+
+  lastfmSubmitTrack(track);
+  if(track->trackID != -1)
+  {
+    validatorTrackPlayed(track->trackID);
+    // Listening all the way through makes up for an earlier skip
+    shuffleAddSkips(shuffleTracks,track->trackID,-1);
+    dbWriterExecInt("UPDATE tracks SET skips=skips-1 WHERE track_id=?1 AND skips > 0",track->trackID);
+  }
+  trackUnref(track);
+}
+
+/*
+ * A new stream has started. If it's the one we queued in aboutToFinish, the
+ * previous track has finished and this one is now current. Runs on the main
+ * thread, its snapshot was filled in when it was picked, so this only
+ * publishes it.
+ */
+void streamStarted (void)
+{
+  struct trackTag *track;
+
+  playbackStarted();
+
+  g_mutex_lock(&preparedLock);
+  track = gaplessTrack;
+  gaplessTrack = NULL;
+  g_mutex_unlock(&preparedLock);
+
+  if(track == NULL)
+  {
+    return;
+  }
+  trackFinished();
+  clearCurrent();
+  setCurrentTrack(track);
+  g_atomic_int_set(&failureHandled,0);
+  prepareNextTrack();
+}
+
+/*
+ * Playback stopped because of error. Record the failure against the track
+ * and move on to the next one, rather than sitting there in silence.
+ */
+void trackFailed (const GError *error)
+{
+  int trackID;
+
+  if(!g_atomic_int_compare_and_exchange(&failureHandled,0,1))
+  {
+    return;
+  }
+
+  // If playbin had moved on to the track queued by aboutToFinish, but it
+  // never started, that is the one that failed
+  g_mutex_lock(&preparedLock);
+  trackID = gaplessTrack != NULL ? gaplessTrack->trackID : trackCurrentID();
+  g_mutex_unlock(&preparedLock);
+
+  if(trackID != -1)
+  {
+    validatorTrackFailed(trackID,error);
+  }
+  nextTrack();
+}
+
 /*
  * Start playback of a file. Expects a fully qualified path (ie. with file://)
  */
-void playFile (char *file)
+void playFile (const char *file)
 {
   clearCurrent();
   // Reset the state to null (stops any current playback)
   gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_NULL);
   // Set the file path
   g_object_set(G_OBJECT(pipeline), "uri", file, NULL);
-  // Run the main iteration to update the UI
-  gtkMainIteration();
+  uiRequestUpdate(UI_UPDATE_LABEL);
   // Start playing
   gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_PLAYING);
 }
@@ -141,8 +689,8 @@ void handleTagMessage (GstTagList *tags)
   gchar *content;
   bool foundArtist = false;
   bool foundTrack = false;
-  // Lock currTrack
-  g_mutex_lock(&currTrack.lock);
+  struct trackTag *current = trackGetCurrent();
+  struct trackTag *track = trackCopy(current);
 
   /*
    * Get the artist. We permit this value to be fetched from multiple locations, so
@@ -152,7 +700,8 @@ void handleTagMessage (GstTagList *tags)
   {
     if (gst_tag_list_get_string(tags,artistTags[i],&content))
     {
-      strcpy(currTrack.trackArtist,content);
+      track->trackArtist = g_intern_string(content);
+      g_free(content);
       foundArtist = true;
       break;
     }
@@ -160,47 +709,59 @@ void handleTagMessage (GstTagList *tags)
 
   if (!foundArtist)
   {
-    strcpy(currTrack.trackArtist,"Unknown artist");
+    track->trackArtist = g_intern_static_string("Unknown artist");
   }
 
   if (gst_tag_list_get_string(tags,GST_TAG_TITLE,&content))
   {
-    strcpy(currTrack.trackName,content);
+    track->trackName = g_intern_string(content);
+    g_free(content);
     foundTrack = true;
   }
   else
   {
     if (gst_tag_list_get_string(tags,GST_TAG_LOCATION,&content))
     {
-      strcpy(currTrack.trackName,content);
+      track->trackName = g_intern_string(content);
+      g_free(content);
     }
     else
     {
-      strcpy(currTrack.trackName,currTrack.currTrackPath);
+      track->trackName = g_intern_string(track->currTrackPath);
     }
   }
 
   if (gst_tag_list_get_string(tags,GST_TAG_ALBUM,&content))
   {
-    currTrack.hasAlbum = true;
-    strcpy(currTrack.trackAlbum,content);
+    track->hasAlbum = true;
+    track->trackAlbum = g_intern_string(content);
+    g_free(content);
   }
   else
   {
-    strcpy(currTrack.trackAlbum,"Unknown album");
+    track->trackAlbum = g_intern_static_string("Unknown album");
   }
 
-  currTrack.hasBasicInfo = (foundTrack && foundArtist);
+  track->hasBasicInfo = (foundTrack && foundArtist);
 
-  // Unlock currTrack
-  g_mutex_unlock(&currTrack.lock);
-  // Display notification if needed
-  if(currTrack.hasAlbum)
+  // Publish it, unless the track has changed while we were at it
+  if(trackSetCurrent(trackRef(track),current))
   {
-    displayTrackNotification();
+    // Interned, so comparing the pointers is enough
+    if(track->trackArtist != current->trackArtist || track->trackName != current->trackName || track->trackAlbum != current->trackAlbum)
+    {
+      tagCacheStore(track);
+    }
+    // Display notification if needed
+    if(track->hasAlbum)
+    {
+      displayTrackNotification();
+    }
+    // Update the label
+    uiRequestUpdate(UI_UPDATE_LABEL);
   }
-  // Update the label
-  updateLabel();
+  trackUnref(track);
+  trackUnref(current);
 }
 
 /*
@@ -209,29 +770,23 @@ void handleTagMessage (GstTagList *tags)
  */
 void displayTrackNotification (void)
 {
+  struct trackTag *track = trackGetCurrent();
   char *summary;
   char *body = NULL;
 
-  if(!currTrack.hasBasicInfo || currTrack.notificationDisplayed)
-  {
-    return;
-  }
-
-  /*
-   * There's a tiny chance that notificationDisplayed has been changed before
-   * we get the mutex, it's so unlikely that we won't bother checking though
-   * (and it is pretty much harmless anyway)
-   */
-  if(g_mutex_trylock(&currTrack.lock) == FALSE)
+  // The flag is only set if we have the basic info, so checking it first
+  // can't lose the notification
+  if(!track->hasBasicInfo || (g_atomic_int_or(&track->flags,TRACK_NOTIFIED) & TRACK_NOTIFIED))
   {
+    trackUnref(track);
     return;
   }
 
   /*
    * Generate the summary string, artist - track
    */
-  summary = malloc(strlen(currTrack.trackArtist)+strlen(currTrack.trackName)+4);
-  sprintf(summary,"%s - %s",currTrack.trackArtist,currTrack.trackName);
+  summary = malloc(strlen(track->trackArtist)+strlen(track->trackName)+4);
+  sprintf(summary,"%s - %s",track->trackArtist,track->trackName);
 
   /*
    * Hide any current notification we've got
@@ -249,10 +804,10 @@ void displayTrackNotification (void)
   /*
    * If we've got an album use that as the body
    */
-  if(currTrack.hasAlbum)
+  if(track->hasAlbum)
   {
-    body = malloc(strlen(currTrack.trackAlbum)+6);
-    sprintf(body,"from %s",currTrack.trackAlbum);
+    body = malloc(strlen(track->trackAlbum)+6);
+    sprintf(body,"from %s",track->trackAlbum);
     g_notification_set_body(notification,"");
   }
   else
@@ -270,10 +825,7 @@ void displayTrackNotification (void)
   {
     free(body);
   }
-
-  currTrack.notificationDisplayed = true;
-
-  g_mutex_unlock(&currTrack.lock);
+  trackUnref(track);
 }
 
 /*
@@ -288,19 +840,21 @@ static gboolean gstMessage (GstBus *bus, GstMessage *msg, gpointer user_data)
   switch (GST_MESSAGE_TYPE(msg))
   {
     case GST_MESSAGE_EOS:
-      // Run the main iteration to update the UI
-      gtkMainIteration();
-
-      lastfmSubmitTrack(currTrack);
+      trackFinished();
       nextTrack();
       break;
+    case GST_MESSAGE_STREAM_START:
+      streamStarted();
+      break;
     case GST_MESSAGE_ERROR:
       g_object_get(G_OBJECT(pipeline),"uri",&file,NULL);
 
       gst_message_parse_error (msg, &err, &dbg_info);
       g_printerr ("ERROR from element %s while playing \"%s\": %s\n", GST_OBJECT_NAME (msg->src), file, err->message);
+      trackFailed(err);
       g_error_free (err);
       g_free (dbg_info);
+      g_free (file);
       break;
     case GST_MESSAGE_TAG:
       gst_message_parse_tag (msg, &tags);
@@ -308,7 +862,9 @@ static gboolean gstMessage (GstBus *bus, GstMessage *msg, gpointer user_data)
       gst_tag_list_free(tags);
       break;
     case GST_MESSAGE_STATE_CHANGED:
-      updateWinStateInfo();
+      // Every element in the pipeline posts these, only the window needs
+      // to know
+      uiRequestUpdate(UI_UPDATE_STATE);
       break;
     case GST_MESSAGE_DURATION:
       setTrackDuration();
@@ -325,11 +881,170 @@ static gboolean gstMessage (GstBus *bus, GstMessage *msg, gpointer user_data)
  */
 void togglePlaying (void)
 {
-  GstState state;
   GtkWidget *nextButton;
   GtkWidget *loveButton;
   GtkWidget *banButton;
 
+  nextButton = GTK_WIDGET(gtk_builder_get_object(randioGlobalState.uiBuilder,"nextButton"));
+  // The state buttons are insensitive until we start playing for the first
+  // time
+  if(gtk_widget_get_sensitive(nextButton))
+  {
+    playbackPost(PLAYBACK_TOGGLE);
+    return;
+  }
+
+  loveButton = GTK_WIDGET(gtk_builder_get_object(randioGlobalState.uiBuilder,"loveButton"));
+  banButton = GTK_WIDGET(gtk_builder_get_object(randioGlobalState.uiBuilder,"banButton"));
+  // Update the label of the play button immediately in order to make the
+  // UI feel responsive to the users actions
+  gtk_stack_set_visible_child_name(GTK_STACK(playStopButton),"playButtonStatePlaying");
+  // Make the state buttons sensitive. This is only done once during our
+  // runtime
+  gtk_widget_set_sensitive(nextButton,true);
+  gtk_widget_set_sensitive(loveButton,true);
+  gtk_widget_set_sensitive(banButton,true);
+  nextTrack();
+}
+
+/*
+ * Play the next track
+ */
+void nextTrack (void)
+{
+  playbackPost(PLAYBACK_NEXT);
+}
+
+/*
+ * Skip the current track at the user's request. Tracks that are skipped
+ * become less likely to be picked.
+ */
+void skipTrack (void)
+{
+  playbackPost(PLAYBACK_SKIP);
+}
+
+/*
+ * Skip to the next track, using the prepared one if we have it. Returns
+ * false if there was nothing to play. Runs on the controller thread.
+ */
+bool nextTrackInThread (void)
+{
+  struct trackTag *track;
+  char *path;
+  GBytes *data = NULL;
+
+  if(!takeNextTrack(&track,&path,&data))
+  {
+    // FIXME: Should tell the user
+    printf("No tracks found in database, will start playing once some are added\n");
+    g_atomic_int_set(&waitingForTracks,1);
+    return false;
+  }
+  playTrack(track,path,data);
+  return true;
+}
+
+/*
+ * Called by the database writer after each commit. If we were asked to play
+ * while the library was empty, have another go now that something has been
+ * written, so that a library that is being scanned starts playing as soon as
+ * the first tracks are committed.
+ */
+void tracksCommitted (void)
+{
+  if(g_atomic_int_compare_and_exchange(&waitingForTracks,1,0))
+  {
+    nextTrack();
+  }
+}
+
+/*
+ * Ban the current track
+ */
+void banTrack (void)
+{
+  playbackPost(PLAYBACK_BAN);
+}
+
+/*
+ * Love the current track
+ */
+void loveTrack (void)
+{
+  playbackPost(PLAYBACK_LOVE);
+}
+
+/*
+ * ********************
+ * Playback controller
+ * ********************
+ */
+
+/*
+ * Queue a command for the controller
+ */
+static void playbackPost (enum playbackCommand command)
+{
+  struct playbackRequest *request = malloc(sizeof(struct playbackRequest));
+  request->command   = command;
+  request->trackID   = trackCurrentID();
+  request->requested = g_get_monotonic_time();
+
+  g_mutex_lock(&playbackLock);
+  g_queue_push_tail(&playbackQueue,request);
+  g_cond_signal(&playbackPending);
+  g_mutex_unlock(&playbackLock);
+}
+
+/*
+ * Make trackID less likely to be picked, the user skipped it
+ */
+void applySkip (int trackID)
+{
+  if(trackID == -1)
+    return;
+  shuffleAddSkips(shuffleTracks,trackID,1);
+  dbWriterExecInt("UPDATE tracks SET skips=skips+1 WHERE track_id=?1",trackID);
+}
+
+/*
+ * Ban trackID
+ */
+void applyBan (int trackID)
+{
+  if(trackID == -1)
+    return;
+
+  // Never pick it again
+  shuffleForgetTrack(trackID);
+
+  // Insert into our banned table
+  dbWriterExecInt("UPDATE tracks SET banned=1 WHERE track_id=?1",trackID);
+
+  // Then drop from loved (if it exists) and tracks
+  dbWriterExecInt("DELETE FROM loved WHERE track_id=?1",trackID);
+}
+
+/*
+ * Love trackID
+ */
+void applyLove (int trackID)
+{
+  if(trackID == -1)
+    return;
+  shuffleSetLoved(shuffleTracks,trackID,true);
+  dbWriterExecInt("INSERT OR IGNORE INTO loved (track_id) VALUES (?1)",trackID);
+}
+
+/*
+ * Pause if we're playing, resume if we're paused, start if we haven't
+ * started yet
+ */
+void applyToggle (void)
+{
+  GstState state;
+
   gst_element_get_state(GST_ELEMENT(pipeline), &state, NULL,GST_CLOCK_TIME_NONE);
   if(state == GST_STATE_PLAYING)
   {
@@ -339,92 +1054,166 @@ void togglePlaying (void)
   {
     gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_PLAYING);
   }
-  // No state, ie. we haven't started playing
   else
   {
-    nextButton = GTK_WIDGET(gtk_builder_get_object(randioGlobalState.uiBuilder,"nextButton"));
-    loveButton = GTK_WIDGET(gtk_builder_get_object(randioGlobalState.uiBuilder,"loveButton"));
-    banButton = GTK_WIDGET(gtk_builder_get_object(randioGlobalState.uiBuilder,"banButton"));
-    // Update the label of the play button immediately in order to make the
-    // UI feel responsive to the users actions
-    gtk_stack_set_visible_child_name(GTK_STACK(playStopButton),"playButtonStatePlaying");
-    // Make the state buttons sensitive. This is only done once during our
-    // runtime
-    gtk_widget_set_sensitive(nextButton,true);
-    gtk_widget_set_sensitive(loveButton,true);
-    gtk_widget_set_sensitive(banButton,true);
-    nextTrack();
+    nextTrackInThread();
   }
 }
 
 /*
- * Runs nextTrack in a thread
+ * Run a batch of commands. Everything that asks for a new track is
+ * collapsed into a single switch, so hammering Next while a switch is
+ * underway plays one track rather than flicking through several. Returns
+ * false if we've been told to stop.
  */
-void nextTrack (void)
+static bool playbackRunBatch (GQueue *batch)
 {
-  g_thread_new("nextTrack", (GThreadFunc) nextTrackInThread,NULL);
+  struct playbackRequest *request;
+  bool switchTrack = false;
+  bool running = true;
+  gint64 requested = 0;
+  int skipped = -1;
+  int toggles = 0;
+
+  while( (request = g_queue_pop_head(batch)) != NULL )
+  {
+    switch(request->command)
+    {
+      case PLAYBACK_SKIP:
+        // Pressing Next several times during the same track is one skip
+        if(request->trackID != skipped)
+        {
+          applySkip(request->trackID);
+          skipped = request->trackID;
+        }
+        break;
+      case PLAYBACK_BAN:
+        applyBan(request->trackID);
+        break;
+      case PLAYBACK_LOVE:
+        applyLove(request->trackID);
+        break;
+      case PLAYBACK_TOGGLE:
+        toggles++;
+        break;
+      case PLAYBACK_STOP:
+        running = false;
+        break;
+      default:
+        break;
+    }
+    if(request->command == PLAYBACK_NEXT || request->command == PLAYBACK_SKIP || request->command == PLAYBACK_BAN)
+    {
+      if(!switchTrack)
+      {
+        requested = request->requested;
+      }
+      switchTrack = true;
+      // A new track starts playing regardless of earlier pauses
+      toggles = 0;
+    }
+    free(request);
+  }
+
+  if(!running)
+  {
+    return false;
+  }
+  if(switchTrack)
+  {
+    g_mutex_lock(&playbackLock);
+    if(switchRequested == 0)
+    {
+      switchRequested = requested;
+    }
+    g_mutex_unlock(&playbackLock);
+    if(!nextTrackInThread())
+    {
+      g_mutex_lock(&playbackLock);
+      switchRequested = 0;
+      g_mutex_unlock(&playbackLock);
+    }
+  }
+  // Pausing twice is the same as not pausing
+  if(toggles % 2)
+  {
+    applyToggle();
+  }
+  return true;
 }
 
 /*
- * Skip to the next track
+ * The playback controller thread
  */
-void nextTrackInThread (void)
+static gpointer playbackRun (gpointer user_data)
 {
-  for(int attempt = 0; attempt < 10; attempt++)
+  GQueue batch;
+  bool running = true;
+
+  while(running)
   {
-    int trackID = SQL_getTrackRND(playOnlyLoved,currTrack);
-    if(trackID == -1)
+    g_mutex_lock(&playbackLock);
+    while(g_queue_is_empty(&playbackQueue))
     {
-      // Delete all already played tracks
-      SQL_exec("DELETE FROM played");
-      trackID = SQL_getTrackRND(playOnlyLoved,currTrack);
-      // FIXME: Should tell the user
-      if(trackID == -1)
-      {
-        printf("No tracks found in database\n");
-        return;
-      }
+      g_cond_wait(&playbackPending,&playbackLock);
     }
-    if (playTrack(trackID))
-      return;
+    // Take everything that has piled up
+    batch = playbackQueue;
+    g_queue_init(&playbackQueue);
+    g_mutex_unlock(&playbackLock);
+
+    running = playbackRunBatch(&batch);
   }
+  return NULL;
 }
 
 /*
- * Ban the current track
+ * A new stream has started playing. If it was asked for by a command,
+ * record how long that took.
  */
-void banTrack (void)
+void playbackStarted (void)
 {
-  if(currTrack.trackID == -1)
-    return;
-  sqlite3_stmt *statement;
-
-  // Insert into our banned table
-  sqlite3_prepare_v2(db,"UPDATE tracks SET banned=1 WHERE track_id=?",-1,&statement, NULL);
-  sqlite3_bind_int(statement, 1, currTrack.trackID);
-  sqlite3_step(statement);
-  sqlite3_finalize(statement);
+  gint64 latency;
 
-  // Then drop from loved (if it exists) and tracks
-  sqlite3_prepare_v2(db,"DELETE FROM loved WHERE track_id=?",-1,&statement, NULL);
-  sqlite3_bind_int(statement, 1, currTrack.trackID);
-  sqlite3_step(statement);
-  sqlite3_finalize(statement);
+  g_mutex_lock(&playbackLock);
+  if(switchRequested != 0)
+  {
+    latency = g_get_monotonic_time()-switchRequested;
+    switchRequested  = 0;
+    switchCount++;
+    switchTotalUsec += latency;
+    switchMaxUsec    = MAX(switchMaxUsec,latency);
+  }
+  g_mutex_unlock(&playbackLock);
+}
 
-  // Finally skip to the next track
-  nextTrack();
+/*
+ * Start the playback controller. Called during startup.
+ */
+void playbackInit (void)
+{
+  playbackThread = g_thread_new("playback",playbackRun,NULL);
 }
 
 /*
- * Love the current track
+ * Stop the playback controller, once it has run any commands that are
+ * already queued, and print how responsive it was
  */
-void loveTrack (void)
+void playbackShutdown (void)
 {
-  if(currTrack.trackID == -1)
+  if(playbackThread == NULL)
+  {
     return;
-  char SQL[254];
-  sprintf(SQL,"INSERT INTO loved (track_id) VALUES (%d)",currTrack.trackID);
-  SQL_exec(SQL);
+  }
+  playbackPost(PLAYBACK_STOP);
+  g_thread_join(playbackThread);
+  playbackThread = NULL;
+
+  if(switchCount > 0)
+  {
+    printf("Switched tracks %d times, taking %" G_GINT64_FORMAT " ms on average and at most %" G_GINT64_FORMAT " ms from request to playback\n",
+        switchCount,switchTotalUsec/switchCount/1000,switchMaxUsec/1000);
+  }
 }
 
 /*
@@ -435,6 +1224,8 @@ void initGST (void)
   pipeline    = gst_element_factory_make("playbin", "player");
   GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
   gst_bus_add_watch(bus, gstMessage, NULL);
+  g_signal_connect(pipeline, "about-to-finish", G_CALLBACK(aboutToFinish), NULL);
+  g_signal_connect(pipeline, "source-setup", G_CALLBACK(sourceSetup), NULL);
   gst_object_unref(bus);
 }
 
@@ -508,7 +1299,7 @@ void handleMediaKeyEvent (GDBusProxy *proxy, gchar *sender_name, gchar *signal_n
   // Handle next
   else if(strcmp(keyPressStr,"Next") == 0)
   {
-    nextTrack();
+    skipTrack();
   }
   // We ignore the following keys: Previous, Rewind, FastForward, Repeat, Shuffle
   //
@@ -586,16 +1377,6 @@ int trackPosition (void)
  * ************
  */
 
-/*
- * Run through the gtk main iteration, processing any events (refreshes the
- * UI). Most places this is used, a separate thread should be used instead.
- */
-void gtkMainIteration (void)
-{
-  while (gtk_events_pending ())
-    gtk_main_iteration ();
-}
-
 /*
  * Construct the main window UI
  */
@@ -605,7 +1386,7 @@ void initUI (void)
   GtkBuilder *menuBuilder;
   randioGlobalState.uiBuilder = gtk_builder_new_from_resource("/org/zerodogg/randio/randio.ui");
   gtk_builder_add_callback_symbol(randioGlobalState.uiBuilder,"togglePlaying",G_CALLBACK(togglePlaying));
-  gtk_builder_add_callback_symbol(randioGlobalState.uiBuilder,"nextTrack",G_CALLBACK(nextTrack));
+  gtk_builder_add_callback_symbol(randioGlobalState.uiBuilder,"skipTrack",G_CALLBACK(skipTrack));
   gtk_builder_add_callback_symbol(randioGlobalState.uiBuilder,"banTrack",G_CALLBACK(banTrack));
   gtk_builder_add_callback_symbol(randioGlobalState.uiBuilder,"loveTrack",G_CALLBACK(loveTrack));
   gtk_builder_connect_signals(randioGlobalState.uiBuilder,NULL);
@@ -628,27 +1409,27 @@ void initUI (void)
  */
 void updateLabel (void)
 {
-  // FIXME
-  char trackLabel[254];
-  char albumLabel[254];
-  if(currTrack.trackName[0] != 0 && currTrack.trackArtist[0] != 0)
+  struct trackTag *track = trackGetCurrent();
+  char *trackLabel;
+  char *albumLabel;
+  if(track->trackName != NULL && track->trackArtist != NULL)
   {
-    sprintf(trackLabel, "%s - %s", currTrack.trackArtist, currTrack.trackName);
-    sprintf(albumLabel, "from %s", currTrack.trackAlbum);
+    trackLabel = g_strdup_printf("%s - %s", track->trackArtist, track->trackName);
+    albumLabel = g_strdup_printf("from %s", track->trackAlbum);
   }
   else
   {
-    sprintf(trackLabel, "(unknown)");
-    sprintf(albumLabel, "(unknown)");
+    trackLabel = g_strdup("(unknown)");
+    albumLabel = g_strdup("(unknown)");
   }
   gtk_label_set_text(GTK_LABEL(playingTrackLabel),trackLabel);
   gtk_label_set_text(GTK_LABEL(playingAlbumLabel),albumLabel);
+  g_free(trackLabel);
+  g_free(albumLabel);
+  trackUnref(track);
 
   // Force a tick to update the time label too
   tick();
-
-  // Run the main iteration to update the UI
-  gtkMainIteration();
 }
 
 /*
@@ -657,7 +1438,13 @@ void updateLabel (void)
 void updateWinStateInfo (void)
 {
   GstState state;
-  gst_element_get_state(GST_ELEMENT(pipeline), &state, NULL,GST_CLOCK_TIME_NONE);
+  GstState pending;
+  // Don't wait for a state change to complete, show where it's heading
+  gst_element_get_state(GST_ELEMENT(pipeline), &state, &pending, 0);
+  if(pending != GST_STATE_VOID_PENDING)
+  {
+    state = pending;
+  }
   switch(state)
   {
     case GST_STATE_PLAYING:
@@ -671,9 +1458,41 @@ void updateWinStateInfo (void)
     default:
       break;
   }
+}
+
+/*
+ * Run the UI updates that have been asked for since the last time
+ */
+static gboolean uiRunUpdates (gpointer user_data)
+{
+  gint updates = g_atomic_int_and(&uiPendingUpdates,0);
 
-  // Run the main iteration to update the UI
-  gtkMainIteration();
+  if(updates & UI_UPDATE_LABEL)
+  {
+    updateLabel();
+  }
+  if(updates & UI_UPDATE_STATE)
+  {
+    updateWinStateInfo();
+  }
+  if(updates & UI_UPDATE_NOTIFICATION)
+  {
+    displayTrackNotification();
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Ask for parts of the window to be refreshed. Can be called from any
+ * thread, the work is done on the main loop. Requests are collected for up
+ * to UI_UPDATE_INTERVAL ms, so that a burst of them only redraws once.
+ */
+void uiRequestUpdate (gint updates)
+{
+  if(g_atomic_int_or(&uiPendingUpdates,updates) == 0)
+  {
+    g_timeout_add(UI_UPDATE_INTERVAL,uiRunUpdates,NULL);
+  }
 }
 
 /*
@@ -720,17 +1539,26 @@ char* getConfDir (void)
  */
 void setTrackDuration (void)
 {
-  int minutes;
-  int seconds;
-  int tpos = trackDuration();
-  minutes = tpos/60;
-  seconds = tpos-(minutes*60);
-  // FIXME: Should lock the mutex
-  sprintf(currTrack.trackLength, "%02d:%02d", minutes, seconds);
-  if(currTrack.trackLenSeconds == 0)
+  struct trackTag *current;
+  struct trackTag *track;
+  int duration = trackDuration();
+
+  if(duration <= 0)
   {
-    currTrack.trackLenSeconds = tpos;
+    return;
+  }
+  current = trackGetCurrent();
+  if(current->trackLenSeconds == 0)
+  {
+    track = trackCopy(current);
+    track->trackLenSeconds = duration;
+    if(trackSetCurrent(trackRef(track),current))
+    {
+      tagCacheStore(track);
+    }
+    trackUnref(track);
   }
+  trackUnref(current);
 }
 
 /*
@@ -742,22 +1570,24 @@ gboolean tick (void)
   {
     return TRUE;
   }
+  struct trackTag *track;
   int tpos    = trackPosition();
   int minutes = tpos/60;
   int seconds = tpos-(minutes*60);
   char currPos[10];
+  char trackLength[10] = "";
   char label[25];
   sprintf(currPos, "%02d:%02d", minutes, seconds);
 
+  setTrackDuration();
+  track = trackGetCurrent();
+
   /*
    * Submit "now playing" to last.fm after 3 seconds
    */
-  if(tpos > 3 && !currTrack.submittedNowPlaying)
+  if(tpos > 3)
   {
-    // Run the main iteration to update the UI
-    gtkMainIteration();
-
-    lastfmSubmitCurrentlyPlaying(currTrack);
+    lastfmSubmitCurrentlyPlaying(track);
   }
   /*
    * Make sure that we have displayed our notification within
@@ -766,38 +1596,28 @@ gboolean tick (void)
    * a track doesn't have an artist, it might end up not displaying
    * at all)
    */
-  if(tpos > 0 && !currTrack.notificationDisplayed)
+  if(tpos > 0)
   {
     displayTrackNotification();
   }
 
-  if(currTrack.trackLength[0] == 0)
+  if(track->trackLenSeconds > 0)
   {
-    setTrackDuration();
+    sprintf(trackLength, "%02d:%02d", track->trackLenSeconds/60, track->trackLenSeconds%60);
   }
+  trackUnref(track);
 
-  sprintf(label,"%s/%s",currPos,currTrack.trackLength);
+  sprintf(label,"%s/%s",currPos,trackLength);
   gtk_label_set_text(GTK_LABEL(timeWidget),label);
   return TRUE;
 }
 
 /*
- * Reset the currTrack struct
+ * Publish an empty current track, ie. when nothing is playing
  */
 void clearCurrent (void)
 {
-  currTrack.trackName[0] = 0;
-  currTrack.trackArtist[0] = 0;
-  currTrack.submittedNowPlaying = false;
-  currTrack.scrobbled = false;
-  currTrack.startedPlaying = 0;
-  currTrack.trackLength[0] = 0;
-  currTrack.trackLenSeconds = 0;
-  currTrack.hasBasicInfo = false;
-  currTrack.hasAlbum = false;
-  currTrack.notificationDisplayed = false;
-  currTrack.trackID = -1;
-  sprintf(currTrack.trackAlbum,"(unknown album)");
+  trackSetCurrent(trackNew(-1,NULL),NULL);
 }
 
 /*
@@ -813,7 +1633,22 @@ static void closeApp (void)
  */
 static void destroyApp (GtkWidget *widget, gpointer data)
 {
-  sqlite3_close(db);
+  // Stop playback first, its streaming threads pick tracks and write to the
+  // database. The controller goes before the pipeline so that it can't
+  // start it again.
+  playbackShutdown();
+  gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_NULL);
+  // Then everything that scans, removes or prepares tracks in the background
+  watcherStop();
+  libraryShutdown();
+  prepareShutdown();
+  // Nothing posts to the writer once the validator has stopped
+  validatorShutdown();
+  dbWriterShutdown();
+  shuffleShutdown();
+  prefetchShutdown();
+  libraryFinalize();
+  SQL_close();
 }
 
 /*
@@ -834,20 +1669,26 @@ void buildGAction (const char *name, void *funcPtr)
  */
 void app_init (GApplication *appRef, gpointer user_data)
 {
-  /*
-   * Initialize the threading system
-   */
-  g_mutex_init(&currTrack.lock);
   /*
    * Initialize
    */
+  // Nothing is playing yet. Has to come first, anything can ask what is.
+  clearCurrent();
   initUI();
   SQLite_init( getConfDir() );
+  shuffleInit( getConfDir() );
+  shuffleSetLovedOnly(shuffleTracks,playOnlyLoved);
+  dbWriterSetCommitHook(tracksCommitted);
+  dbWriterInit();
   initGST();
+  playbackInit();
   lastfmInit();
   initMediaKeys();
-  // Initializes currTrack to default values
-  clearCurrent();
+  // Pick up any changes made to the library while we weren't running
+  libraryResumePurges();
+  libraryRescanInBackground();
+  watcherInit();
+  validatorInit();
   /*
    * Set our tick function, runs once every 0.5s
    */
@@ -858,7 +1699,7 @@ void app_init (GApplication *appRef, gpointer user_data)
   buildGAction("quit",&closeApp);
   buildGAction("showAboutBox",&showAboutBox);
   buildGAction("loveTrack",&loveTrack);
-  buildGAction("nextTrack",&nextTrack);
+  buildGAction("nextTrack",&skipTrack);
 }
 
 /*
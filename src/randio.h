@@ -18,23 +18,52 @@
 #define STUB printf("STUB: %s at %s:%d\n",__FUNCTION__,__FILE__,__LINE__)
 
 void initUI (void);
-bool playTrack (int trackID);
-void addFileToLib (char *file);
-void playFile (char *file);
+bool pickTrack (int skip, int *trackID, char **path);
+bool takePreparedTrack (struct trackTag **track, char **path, GBytes **data);
+bool takeNextTrack (struct trackTag **track, char **path, GBytes **data);
+void prepareNextTrackInThread (void);
+void prepareNextTrack (void);
+struct trackTag *trackNew (int trackID, const char *uri);
+struct trackTag *trackLoad (int trackID, const char *path);
+struct trackTag *trackCopy (struct trackTag *track);
+struct trackTag *trackRef (struct trackTag *track);
+void trackUnref (struct trackTag *track);
+struct trackTag *trackGetCurrent (void);
+int trackCurrentID (void);
+bool trackSetCurrent (struct trackTag *track, struct trackTag *previous);
+void setCurrentTrack (struct trackTag *track);
+void setSourceData (GBytes *data);
+void playTrack (struct trackTag *track, char *path, GBytes *data);
+void aboutToFinish (GstElement *playbin, gpointer user_data);
+void sourceSetup (GstElement *playbin, GstElement *source, gpointer user_data);
+void trackFinished (void);
+void streamStarted (void);
+void trackFailed (const GError *error);
+void playFile (const char *file);
 void tagInfo (const GstTagList *list, const gchar *tag, gpointer user_data);
 void displayTrackNotification (void);
 static gboolean gstMessage (GstBus *bus, GstMessage *msg, gpointer user_data);
 void togglePlaying (void);
-void nextTrackInThread (void);
+bool nextTrackInThread (void);
 void nextTrack (void);
+void skipTrack (void);
+void tracksCommitted (void);
 void banTrack (void);
 void loveTrack (void);
+void applySkip (int trackID);
+void applyBan (int trackID);
+void applyLove (int trackID);
+void applyToggle (void);
+void playbackStarted (void);
+void playbackInit (void);
+void playbackShutdown (void);
 void initGST (void);
 void buildUI (void);
 void buildGAction (const char *name, void *funcPtr);
 void handleTagMessage (GstTagList *tags);
 void updateLabel (void);
 void updateWinStateInfo (void);
+void uiRequestUpdate (gint updates);
 void showAboutBox (void);
 void clearCurrent (void);
 static void closeApp (void);
@@ -45,7 +74,6 @@ void loadConfig (void);
 gboolean tick(void);
 char* getConfDir (void);
 static void destroyApp (GtkWidget *widget, gpointer data);
-void gtkMainIteration (void);
 int trackPosition (void);
 void setTrackDuration (void);
 void app_init (GApplication *app, gpointer user_data);
@@ -54,4 +82,3 @@ int main (int argc, char *argv[]);
 
 /* Shared global variables */
 extern bool playOnlyLoved;
-extern struct trackTag currTrack;